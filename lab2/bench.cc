@@ -0,0 +1,244 @@
+// Host-side microbenchmarks for the predictor data structures.
+//
+//   bench counters      2-bit counter table lookups/sec, packed vs UINT32
+//   bench tage [spec ...]
+//                       ns per predict+update on a synthetic branch stream,
+//                       one branch at a time and in PredictBlock/UpdateBlock
+//                       calls, for each spec (default tage), e.g. bench tage
+//                       tage perceptron
+//   bench trace <trace> <packed>
+//                       records/sec read from a CBP trace and its packed copy
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packedtrace.h"
+#include "predictor.h"
+
+static double Now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// deterministic pseudo-random PC stream
+static UINT32 NextPC(UINT32& x) {
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return x;
+}
+
+/////////////////////////////////////////////////////////////
+// counters
+/////////////////////////////////////////////////////////////
+// The layout the bimodal and two-level tables used before packing:
+// one UINT32 per counter.
+class WordCounterArray {
+public:
+   WordCounterArray(UINT32 entries, UINT32 init) : mem(entries, init) {}
+   bool Taken(UINT32 i) const { return mem[i] >= 2; }
+   void Update(UINT32 i, bool taken) {
+      if(taken && mem[i] != 3) mem[i]++;
+      else if(!taken && mem[i] != 0) mem[i]--;
+   }
+   size_t Bytes() const { return mem.size() * sizeof(UINT32); }
+private:
+   std::vector<UINT32> mem;
+};
+
+template <class TABLE>
+static double RunCounters(TABLE& table, UINT32 entries, UINT64 lookups, UINT64* taken) {
+   UINT32 x = 2463534242u;
+   UINT64 t = 0;
+   double start = Now();
+   for(UINT64 i = 0; i < lookups; i++){
+      UINT32 pc = NextPC(x);
+      UINT32 idx = pc & (entries - 1);
+      bool pred = table.Taken(idx);
+      t += pred;
+      table.Update(idx, (pc >> 31) ^ pred);
+   }
+   *taken = t;
+   return lookups / (Now() - start);
+}
+
+static void BenchCounters() {
+   const UINT32 sizes[] = {4096, 65536, 1 << 20};
+   const UINT64 lookups = 20000000;
+   printf("%10s %12s %14s %12s %14s %8s\n",
+          "entries", "word_bytes", "word_lookup/s", "packed_bytes", "packed_lookup/s", "speedup");
+   for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+      UINT32 n = sizes[s];
+      UINT64 t0, t1;
+      WordCounterArray word(n, 1);
+      PackedCounterArray packed(n, 1);
+      double w = RunCounters(word, n, lookups, &t0);
+      double p = RunCounters(packed, n, lookups, &t1);
+      if(t0 != t1){
+         fprintf(stderr, "packed table diverged at %u entries\n", n);
+         exit(-1);
+      }
+      printf("%10u %12zu %14.3e %12zu %14.3e %7.2fx\n",
+             n, word.Bytes(), w, packed.Bytes(), p, p / w);
+   }
+}
+
+/////////////////////////////////////////////////////////////
+// tage
+/////////////////////////////////////////////////////////////
+// A fixed synthetic stream: a few thousand static branches, most of them
+// loop exits or history-correlated, so every TAGE component is exercised.
+static void MakeStream(std::vector<BranchRecord>& stream, size_t n) {
+   const UINT32 statics = 4096;
+   std::vector<UINT32> trip(statics), count(statics, 0);
+   UINT32 x = 88172645u;
+   for(UINT32 i = 0; i < statics; i++){
+      trip[i] = 2 + NextPC(x) % 48;
+   }
+   UINT32 hist = 0;
+   stream.resize(n);
+   for(size_t k = 0; k < n; k++){
+      UINT32 b = ((k / 256) * 37 + (k % 16)) % statics;
+      UINT32 r = NextPC(x);
+      bool taken;
+      switch(b % 4){
+         case 0:  taken = (++count[b] % trip[b]) != 0; break;
+         case 1:  taken = ((hist >> 2) ^ (hist >> 5)) & 1; break;
+         case 2:  taken = (r % 16) != 0; break;
+         default: taken = (b >> 2) & 1; break;
+      }
+      hist = (hist << 1) | taken;
+      stream[k].PC = 0x400000 + b * 12;
+      stream[k].branchTarget = stream[k].PC + (taken ? 64 : 4);
+      stream[k].resolveDir = taken;
+   }
+}
+
+static Predictor* MakePredictor(const char* spec) {
+   Predictor* pred = CreatePredictor(spec);
+   if(pred == NULL){
+      fprintf(stderr, "invalid predictor spec: %s\n", spec);
+      exit(-1);
+   }
+   return pred;
+}
+
+// Times the stream through one GetPrediction/UpdatePredictor pair per
+// branch and through PredictBlock/UpdateBlock calls of each block size.
+// Larger blocks predict from older histories, so they mispredict more. A
+// block of one matches the single-branch calls unless the predictor
+// delays its training, which the block calls do not.
+static void BenchPredictor(const char* spec) {
+   const size_t n = 4000000;
+   const int blockSizes[] = {1, 4, 16, 64};
+   std::vector<BranchRecord> stream;
+   MakeStream(stream, n);
+   std::vector<UINT32> PCs(n), targets(n);
+   std::vector<char> dirs(n);
+   for(size_t k = 0; k < n; k++){
+      PCs[k] = stream[k].PC;
+      targets[k] = stream[k].branchTarget;
+      dirs[k] = stream[k].resolveDir;
+   }
+
+   Predictor* pred = MakePredictor(spec);
+   UINT64 miss = 0;
+   double start = Now();
+   for(size_t k = 0; k < n; k++){
+      bool predDir = pred->GetPrediction(stream[k].PC);
+      pred->UpdatePredictor(stream[k].PC, stream[k].resolveDir, predDir, stream[k].branchTarget);
+      miss += (predDir != stream[k].resolveDir);
+   }
+   double single = Now() - start;
+   printf("%s: %zu branches, %llu mispredictions, %.1f ns per predict+update\n",
+          spec, n, (unsigned long long)miss, single * 1e9 / n);
+   delete pred;
+
+   bool block[64];
+   bool outcome[64];
+   for(size_t b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); b++){
+      int size = blockSizes[b];
+      pred = MakePredictor(spec);
+      UINT64 blockMiss = 0;
+      start = Now();
+      for(size_t k = 0; k < n; k += size){
+         int m = (int)(n - k < (size_t)size ? n - k : size);
+         pred->PredictBlock(&PCs[k], m, block);
+         for(int j = 0; j < m; j++){
+            outcome[j] = dirs[k + j];
+            blockMiss += (block[j] != outcome[j]);
+         }
+         pred->UpdateBlock(&PCs[k], m, outcome, block, &targets[k]);
+      }
+      double elapsed = Now() - start;
+      if(size == 1 && blockMiss != miss){
+         fprintf(stderr, "note: blocks of one differ from single-branch calls\n");
+      }
+      printf("  block of %2d: %.1f ns per branch (%.2fx), %llu mispredictions\n",
+             size, elapsed * 1e9 / n, single / elapsed, (unsigned long long)blockMiss);
+      delete pred;
+   }
+}
+
+/////////////////////////////////////////////////////////////
+// trace
+/////////////////////////////////////////////////////////////
+template <class READER>
+static double ReadAll(READER* reader, UINT64* records, UINT64* check) {
+   OpType opType;
+   UINT32 PC, target;
+   bool taken;
+   UINT64 n = 0, sum = 0;
+   double start = Now();
+   while(reader->GetNextRecord(&PC, &opType, &taken, &target)){
+      n++;
+      sum += PC ^ target ^ taken ^ opType;
+   }
+   double elapsed = Now() - start;
+   *records = n;
+   *check = sum;
+   return n / elapsed;
+}
+
+static void BenchTrace(char* trace, const char* packed) {
+   UINT64 n0, n1, c0, c1;
+   CBP_TRACE_READER* cbptr = new CBP_TRACE_READER(trace);
+   double r0 = ReadAll(cbptr, &n0, &c0);
+   delete cbptr;
+   PackedTraceReader reader;
+   if(!reader.Open(packed)){
+      fprintf(stderr, "cannot read packed trace %s\n", packed);
+      exit(-1);
+   }
+   double r1 = ReadAll(&reader, &n1, &c1);
+   if(n0 != n1 || c0 != c1){
+      fprintf(stderr, "packed trace does not match %s\n", trace);
+      exit(-1);
+   }
+   printf("%llu records: cbp %.3e records/s, packed %.3e records/s (%.2fx)\n",
+          (unsigned long long)n0, r0, r1, r1 / r0);
+}
+
+int main(int argc, char* argv[]) {
+   if(argc < 2){
+      fprintf(stderr, "usage: %s counters | tage [spec ...] | trace <trace> <packed>\n", argv[0]);
+      exit(-1);
+   }
+   if(strcmp(argv[1], "counters") == 0){
+      BenchCounters();
+   }else if(strcmp(argv[1], "tage") == 0){
+      if(argc == 2) BenchPredictor("tage");
+      for(int i = 2; i < argc; i++){
+         BenchPredictor(argv[i]);
+      }
+   }else if(strcmp(argv[1], "trace") == 0 && argc == 4){
+      BenchTrace(argv[2], argv[3]);
+   }else{
+      fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+      exit(-1);
+   }
+   return 0;
+}
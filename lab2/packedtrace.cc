@@ -0,0 +1,230 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "packedtrace.h"
+
+static const char PTRACE_MAGIC[4] = {'B', 'P', 'T', 'R'};
+static const UINT32 PTRACE_VERSION = 1;
+static const size_t PTRACE_HEADER = 16; // magic, version, record count
+static const size_t BLOCK_HEADER = 8;   // record count, payload bytes
+
+/////////////////////////////////////////////////////////////
+// Encoding helpers
+/////////////////////////////////////////////////////////////
+static void PutLE(std::vector<UINT8>& out, UINT64 v, int bytes) {
+   for(int i = 0; i < bytes; i++){
+      out.push_back((UINT8)(v >> (8 * i)));
+   }
+}
+
+static UINT64 GetLE(const UINT8* p, int bytes) {
+   UINT64 v = 0;
+   for(int i = 0; i < bytes; i++){
+      v |= (UINT64)p[i] << (8 * i);
+   }
+   return v;
+}
+
+// signed deltas map to small unsigned values: 0, -1, 1, -2, ...
+static UINT32 ZigZag(INT32 v) {
+   return ((UINT32)v << 1) ^ (UINT32)(v >> 31);
+}
+
+static INT32 UnZigZag(UINT32 v) {
+   return (INT32)(v >> 1) ^ -(INT32)(v & 1);
+}
+
+static void PutVarint(std::vector<UINT8>& out, UINT32 v) {
+   while(v >= 0x80){
+      out.push_back((UINT8)(v | 0x80));
+      v >>= 7;
+   }
+   out.push_back((UINT8)v);
+}
+
+// decodes one varint, or returns NULL if it runs past end
+static const UINT8* GetVarint(const UINT8* p, const UINT8* end, UINT32* v) {
+   if(p < end && *p < 0x80){
+      *v = *p;
+      return p + 1;
+   }
+   UINT32 r = 0;
+   for(int shift = 0; shift < 35; shift += 7){
+      if(p == end) return NULL;
+      UINT8 b = *p++;
+      r |= (UINT32)(b & 0x7f) << shift;
+      if(b < 0x80){
+         *v = r;
+         return p;
+      }
+   }
+   return NULL;
+}
+
+/////////////////////////////////////////////////////////////
+// Writer
+/////////////////////////////////////////////////////////////
+bool PackedTraceWriter::Open(const char* path) {
+   file = fopen(path, "wb");
+   if(file == NULL) return false;
+   ok = true;
+   numRecords = 0;
+   buf.resize(4);
+   memcpy(buf.data(), PTRACE_MAGIC, 4);
+   PutLE(buf, PTRACE_VERSION, 4);
+   PutLE(buf, 0, 8);
+   ok = fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+   return ok;
+}
+
+void PackedTraceWriter::Add(UINT32 PC, OpType opType, bool taken, UINT32 target) {
+   pcs.push_back(PC);
+   targets.push_back(target);
+   ops.push_back((UINT8)opType);
+   dirs.push_back(taken);
+   numRecords++;
+   if(pcs.size() == BLOCK_RECORDS){
+      WriteBlock();
+   }
+}
+
+void PackedTraceWriter::WriteBlock() {
+   UINT32 n = (UINT32)pcs.size();
+   buf.clear();
+   PutLE(buf, n, 4);
+   PutLE(buf, 0, 4); // payload size, patched below
+   buf.insert(buf.end(), ops.begin(), ops.end());
+   for(UINT32 i = 0; i < n; i += 8){
+      UINT8 b = 0;
+      for(UINT32 j = 0; j < 8 && i + j < n; j++) b |= (UINT8)dirs[i + j] << j;
+      buf.push_back(b);
+   }
+   UINT32 prev = 0;
+   for(UINT32 i = 0; i < n; i++){
+      PutVarint(buf, ZigZag((INT32)(pcs[i] - prev)));
+      prev = pcs[i];
+   }
+   for(UINT32 i = 0; i < n; i++){
+      PutVarint(buf, ZigZag((INT32)(targets[i] - pcs[i])));
+   }
+   UINT32 payload = (UINT32)(buf.size() - BLOCK_HEADER);
+   for(int i = 0; i < 4; i++) buf[4 + i] = (UINT8)(payload >> (8 * i));
+   ok = ok && fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+
+   pcs.clear();
+   targets.clear();
+   ops.clear();
+   dirs.clear();
+}
+
+bool PackedTraceWriter::Close() {
+   if(file == NULL) return ok;
+   if(!pcs.empty()) WriteBlock();
+   std::vector<UINT8> count;
+   PutLE(count, numRecords, 8);
+   ok = ok && fseek(file, 8, SEEK_SET) == 0 && fwrite(count.data(), 1, 8, file) == 8;
+   ok = (fclose(file) == 0) && ok;
+   file = NULL;
+   return ok;
+}
+
+/////////////////////////////////////////////////////////////
+// Reader
+/////////////////////////////////////////////////////////////
+PackedTraceReader::~PackedTraceReader() {
+   if(base != NULL) munmap((void*)base, size);
+}
+
+bool PackedTraceReader::IsPackedTrace(const char* path) {
+   FILE* f = fopen(path, "rb");
+   if(f == NULL) return false;
+   char magic[4];
+   bool packed = fread(magic, 1, 4, f) == 4 && memcmp(magic, PTRACE_MAGIC, 4) == 0;
+   fclose(f);
+   return packed;
+}
+
+bool PackedTraceReader::Open(const char* path) {
+   int fd = open(path, O_RDONLY);
+   if(fd < 0) return false;
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < PTRACE_HEADER){
+      close(fd);
+      return false;
+   }
+   void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(p == MAP_FAILED) return false;
+   base = (const UINT8*)p;
+   size = st.st_size;
+   madvise(p, size, MADV_SEQUENTIAL);
+
+   if(memcmp(base, PTRACE_MAGIC, 4) != 0 || GetLE(base + 4, 4) != PTRACE_VERSION){
+      munmap(p, size);
+      base = NULL;
+      return false;
+   }
+   numRecords = GetLE(base + 8, 8);
+   cur = base + PTRACE_HEADER;
+   end = base + size;
+   decoded = 0;
+   corrupt = false;
+   pos = count = 0;
+   return true;
+}
+
+// decodes the next block into the column arrays; a truncated or corrupt
+// block ends the trace and marks it corrupt
+bool PackedTraceReader::DecodeBlock() {
+   if(cur == NULL) return false;
+   if(cur == end){
+      corrupt = (decoded != numRecords);
+      cur = NULL;
+      return false;
+   }
+   if((size_t)(end - cur) < BLOCK_HEADER){
+      corrupt = true;
+      cur = NULL;
+      return false;
+   }
+   UINT32 n = (UINT32)GetLE(cur, 4);
+   UINT32 payload = (UINT32)GetLE(cur + 4, 4);
+   const UINT8* p = cur + BLOCK_HEADER;
+   if(n == 0 || n > PackedTraceWriter::BLOCK_RECORDS ||
+      payload > (size_t)(end - p) || payload < n + (n + 7) / 8){
+      corrupt = true;
+      cur = NULL;
+      return false;
+   }
+   const UINT8* blockEnd = p + payload;
+
+   memcpy(ops, p, n);
+   p += n;
+   memcpy(dirs, p, (n + 7) / 8);
+   p += (n + 7) / 8;
+   UINT32 prev = 0;
+   for(UINT32 i = 0; i < n && p != NULL; i++){
+      UINT32 v = 0;
+      p = GetVarint(p, blockEnd, &v);
+      prev += (UINT32)UnZigZag(v);
+      pcs[i] = prev;
+   }
+   for(UINT32 i = 0; i < n && p != NULL; i++){
+      UINT32 v = 0;
+      p = GetVarint(p, blockEnd, &v);
+      targets[i] = pcs[i] + (UINT32)UnZigZag(v);
+   }
+   if(p != blockEnd){
+      corrupt = true;
+      cur = NULL;
+      return false;
+   }
+   cur = blockEnd;
+   decoded += n;
+   pos = 0;
+   count = n;
+   return true;
+}
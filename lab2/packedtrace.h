@@ -0,0 +1,113 @@
+#ifndef _PACKEDTRACE_H_
+#define _PACKEDTRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "utils.h"
+#include "tracer.h"
+
+/////////////////////////////////////////////////////////////
+// Packed branch trace
+/////////////////////////////////////////////////////////////
+// A compact on-disk copy of a CBP trace that is cheap to replay. After a
+// header holding the magic "BPTR", a version and the record count, the
+// records are stored in blocks of up to BLOCK_RECORDS. Each block starts
+// with its record count and payload size, followed by one column per
+// field:
+//
+//   op      one byte per record
+//   taken   one bit per record
+//   PC      zigzag varint of the delta to the previous PC in the block
+//   target  zigzag varint of target - PC
+//
+// Branch PCs are close together and most targets are short forward or
+// backward jumps, so the two varint columns are mostly one or two bytes.
+// The reader maps the file and decodes a whole block at a time into
+// flat arrays; GetNextRecord then just walks them. Values are stored
+// little-endian, independent of the host.
+
+class PackedTraceWriter {
+public:
+   static const UINT32 BLOCK_RECORDS = 4096;
+
+   PackedTraceWriter() : file(NULL), ok(true), numRecords(0) {}
+   ~PackedTraceWriter() { Close(); }
+
+   // Creates path and writes a provisional header. Returns false if the
+   // file cannot be created.
+   bool Open(const char* path);
+
+   void Add(UINT32 PC, OpType opType, bool taken, UINT32 target);
+
+   // Writes the last block and the final record count. Returns false if
+   // any write failed.
+   bool Close();
+
+   UINT64 GetNumRecords() const { return numRecords; }
+
+private:
+   void WriteBlock();
+
+   FILE* file;
+   bool ok;
+   UINT64 numRecords;
+   std::vector<UINT32> pcs;
+   std::vector<UINT32> targets;
+   std::vector<UINT8> ops;
+   std::vector<bool> dirs;
+   std::vector<UINT8> buf;
+};
+
+class PackedTraceReader {
+public:
+   PackedTraceReader()
+      : base(NULL), size(0), cur(NULL), end(NULL), numRecords(0), decoded(0), corrupt(false),
+        pos(0), count(0) {}
+   ~PackedTraceReader();
+
+   // Maps a packed trace. Returns false if the file cannot be mapped or
+   // does not start with a packed trace header.
+   bool Open(const char* path);
+
+   // True if path starts with the packed trace magic.
+   static bool IsPackedTrace(const char* path);
+
+   // Same contract as CBP_TRACE_READER::GetNextRecord.
+   bool GetNextRecord(UINT32* PC, OpType* opType, bool* taken, UINT32* target) {
+      if(pos == count && !DecodeBlock()) return false;
+      *PC = pcs[pos];
+      *opType = (OpType)ops[pos];
+      *taken = (dirs[pos >> 3] >> (pos & 7)) & 1;
+      *target = targets[pos];
+      pos++;
+      return true;
+   }
+
+   UINT64 GetNumRecords() const { return numRecords; }
+
+   // True once GetNextRecord has stopped at a truncated or corrupt block,
+   // or at the end of the file before the record count of the header.
+   bool IsCorrupt() const { return corrupt; }
+
+private:
+   bool DecodeBlock();
+
+   const UINT8* base;
+   size_t size;
+   const UINT8* cur;
+   const UINT8* end;
+   UINT64 numRecords;
+   UINT64 decoded; // records in the blocks decoded so far
+   bool corrupt;
+   UINT32 pos;
+   UINT32 count;
+   UINT32 pcs[PackedTraceWriter::BLOCK_RECORDS];
+   UINT32 targets[PackedTraceWriter::BLOCK_RECORDS];
+   UINT8 ops[PackedTraceWriter::BLOCK_RECORDS];
+   UINT8 dirs[PackedTraceWriter::BLOCK_RECORDS / 8];
+};
+
+#endif
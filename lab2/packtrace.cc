@@ -0,0 +1,71 @@
+// Converts a CBP trace to the packed branch trace format read by sweep
+// and bench, so later runs skip the trace decompression and parsing.
+//
+//   packtrace <trace> <packed>
+//
+// With -v the packed file is read back and compared record by record.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packedtrace.h"
+
+int main(int argc, char* argv[]) {
+   bool verify = (argc == 4 && strcmp(argv[1], "-v") == 0);
+   if(argc - verify != 3){
+      fprintf(stderr, "usage: %s [-v] <trace> <packed>\n", argv[0]);
+      exit(-1);
+   }
+   char* in = argv[1 + verify];
+   const char* out = argv[2 + verify];
+
+   PackedTraceWriter writer;
+   if(!writer.Open(out)){
+      fprintf(stderr, "cannot create %s\n", out);
+      exit(-1);
+   }
+   CBP_TRACE_READER* cbptr = new CBP_TRACE_READER(in);
+   OpType opType;
+   UINT32 PC;
+   bool branchTaken;
+   UINT32 branchTarget;
+   while(cbptr->GetNextRecord(&PC, &opType, &branchTaken, &branchTarget)){
+      writer.Add(PC, opType, branchTaken, branchTarget);
+   }
+   delete cbptr;
+   UINT64 numRecords = writer.GetNumRecords();
+   if(!writer.Close()){
+      fprintf(stderr, "error writing %s\n", out);
+      exit(-1);
+   }
+   printf("%llu records written to %s\n", (unsigned long long)numRecords, out);
+
+   if(verify){
+      PackedTraceReader reader;
+      if(!reader.Open(out) || reader.GetNumRecords() != numRecords){
+         fprintf(stderr, "cannot read back %s\n", out);
+         exit(-1);
+      }
+      cbptr = new CBP_TRACE_READER(in);
+      OpType op2;
+      UINT32 PC2, target2;
+      bool taken2;
+      UINT64 n = 0;
+      while(cbptr->GetNextRecord(&PC, &opType, &branchTaken, &branchTarget)){
+         if(!reader.GetNextRecord(&PC2, &op2, &taken2, &target2) || PC != PC2 ||
+            opType != op2 || branchTaken != taken2 || branchTarget != target2){
+            fprintf(stderr, "record %llu differs\n", (unsigned long long)n);
+            exit(-1);
+         }
+         n++;
+      }
+      delete cbptr;
+      if(reader.GetNextRecord(&PC2, &op2, &taken2, &target2)){
+         fprintf(stderr, "packed trace has extra records\n");
+         exit(-1);
+      }
+      printf("verified %llu records\n", (unsigned long long)n);
+   }
+   return 0;
+}
@@ -1,3 +1,14 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+
 #include "predictor.h"
 
 typedef enum{
@@ -8,37 +19,89 @@ typedef enum{
 } state_t;
 
 /////////////////////////////////////////////////////////////
-// 2bitsat
+// Storage accounting helpers
 /////////////////////////////////////////////////////////////
-#define SIZE_2BITSAT 4096
+static void AddStorage(std::vector<StorageComponent>& parts, const char* name, UINT64 bits) {
+   StorageComponent part = {name, bits};
+   parts.push_back(part);
+}
 
-UINT32 mem_2bitsat[SIZE_2BITSAT];
-void InitPredictor_2bitsat() {
-   for(int i = 0; i < SIZE_2BITSAT; i++){
-      mem_2bitsat[i] = WEAKLY_NOT_TAKEN;
+// number of bits needed to hold the values 0..n-1
+static UINT32 CeilLog2(UINT32 n) {
+   UINT32 bits = 0;
+   while(bits < 32 && (1ULL << bits) < n) bits++;
+   return bits;
+}
+
+UINT64 Predictor::GetStorageBits() const {
+   std::vector<StorageComponent> parts;
+   GetStorage(parts);
+   UINT64 total = 0;
+   for(size_t i = 0; i < parts.size(); i++){
+      total += parts[i].bits;
    }
+   return total;
 }
 
-bool GetPrediction_2bitsat(UINT32 PC) {
-   UINT32 pred = mem_2bitsat[PC % SIZE_2BITSAT]; 
-   if(pred == STRONGLY_NOT_TAKEN || pred == WEAKLY_NOT_TAKEN){
-      return NOT_TAKEN;
-   }else{
-      return TAKEN;
+void Predictor::PredictBlock(const UINT32* PCs, int n, bool* predDirs) {
+   for(int k = 0; k < n; k++){
+      predDirs[k] = GetPrediction(PCs[k]);
    }
 }
 
-void UpdatePredictor_2bitsat(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
-   UINT32 idx = PC % SIZE_2BITSAT;
-   if(resolveDir == TAKEN){
-      if(mem_2bitsat[idx] != STRONGLY_TAKEN){
-         mem_2bitsat[idx]++;
-      }
-   } else {
-      if(mem_2bitsat[idx] != STRONGLY_NOT_TAKEN){
-         mem_2bitsat[idx]--;
-      }
+void Predictor::UpdateBlock(const UINT32* PCs, int n, const bool* resolveDirs,
+                            const bool* predDirs, const UINT32* branchTargets) {
+   for(int k = 0; k < n; k++){
+      // refreshes what UpdatePredictor keeps from the last GetPrediction
+      GetPrediction(PCs[k]);
+      UpdatePredictor(PCs[k], resolveDirs[k], predDirs[k], branchTargets[k]);
+   }
+}
+
+// Largest counter or history table a spec may ask for, 16 MB of packed
+// counters. Keeps table sizes and their index arithmetic within UINT32.
+#define MAX_TABLE_ENTRIES (1u << 26)
+
+/////////////////////////////////////////////////////////////
+// 2bitsat
+/////////////////////////////////////////////////////////////
+#define SIZE_2BITSAT 4096
+
+class Predictor_2bitsat : public Predictor {
+   UINT32 size;
+   PackedCounterArray mem_2bitsat;
+
+public:
+   Predictor_2bitsat(UINT32 entries = SIZE_2BITSAT)
+      : size(entries), mem_2bitsat(entries, WEAKLY_NOT_TAKEN) {}
+
+   bool GetPrediction(UINT32 PC) {
+      return mem_2bitsat.Taken(PC % size) ? TAKEN : NOT_TAKEN;
+   }
+
+   void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+      mem_2bitsat.Update(PC % size, resolveDir == TAKEN);
+   }
+
+   void GetStorage(std::vector<StorageComponent>& parts) const {
+      AddStorage(parts, "counters", (UINT64)size * 2);
+   }
+
+   void SaveState(StateWriter& out) const {
+      mem_2bitsat.Save(out);
+   }
+
+   bool LoadState(StateReader& in) {
+      return mem_2bitsat.Load(in);
    }
+};
+
+// spec: 2bitsat[:entries]
+static Predictor* Create_2bitsat(const std::vector<UINT32>& args) {
+   if(args.size() > 1) return NULL;
+   UINT32 entries = args.size() > 0 ? args[0] : SIZE_2BITSAT;
+   if(entries == 0 || entries > MAX_TABLE_ENTRIES) return NULL;
+   return new Predictor_2bitsat(entries);
 }
 
 /////////////////////////////////////////////////////////////
@@ -47,71 +110,85 @@ void UpdatePredictor_2bitsat(UINT32 PC, bool resolveDir, bool predDir, UINT32 br
 #define SIZE_BHT 512
 #define PHT_COL 8
 #define PHT_ROW 64
-UINT32 BHT[SIZE_BHT]; 
-UINT32 PHT[PHT_COL][PHT_ROW];
 
-void InitPredictor_2level() {
-   // initialize all prediction entries to weakly not taken 
-   for(int i = 0; i < PHT_COL; i++){
-      for(int j = 0; j < PHT_ROW; j++){
-         PHT[i][j] = WEAKLY_NOT_TAKEN;
-      }
+class Predictor_2level : public Predictor {
+   UINT32 size_bht;
+   UINT32 pht_col;
+   UINT32 pht_row;
+   std::vector<UINT32> BHT;
+   PackedCounterArray PHT; // pht_col x pht_row, row-major by column index
+
+public:
+   Predictor_2level(UINT32 bht = SIZE_BHT, UINT32 col = PHT_COL, UINT32 row = PHT_ROW)
+      : size_bht(bht), pht_col(col), pht_row(row),
+        // initialize all history entries to not taken
+        BHT(bht, 0),
+        // initialize all prediction entries to weakly not taken 
+        PHT(col * row, WEAKLY_NOT_TAKEN) {}
+
+   bool GetPrediction(UINT32 PC) {
+      UINT32 BHT_idx = (PC >> 3) % size_bht;
+      UINT32 PHT_idx1 = (PC % pht_col);
+      UINT32 PHT_idx2 = (BHT[BHT_idx] % pht_row);
+      return PHT.Taken(PHT_idx1 * pht_row + PHT_idx2) ? TAKEN : NOT_TAKEN;
    }
 
-   // initialize all history entries to not taken
-   for(int i = 0; i < SIZE_BHT; i++){
-      BHT[i] = 0;
+   void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+      UINT32 PHT_idx1 = (PC % pht_col);
+      UINT32 BHT_idx = (PC >> 3) % size_bht;
+      UINT32 PHT_idx2 = (BHT[BHT_idx] % pht_row);
+      // update entry in BHT
+      BHT[BHT_idx] = ((BHT[BHT_idx] << 1) | resolveDir) % pht_row;
+      
+      // update prediction in PHT
+      PHT.Update(PHT_idx1 * pht_row + PHT_idx2, resolveDir == TAKEN);
    }
-}
 
-bool GetPrediction_2level(UINT32 PC) {
-   UINT32 BHT_idx = (PC >> 3) % SIZE_BHT;
-   UINT32 PHT_idx1 = (PC % PHT_COL);
-   UINT32 PHT_idx2 = (BHT[BHT_idx] % PHT_ROW);
-   UINT32 pred = PHT[PHT_idx1][PHT_idx2];
-   if(pred == STRONGLY_TAKEN || pred == WEAKLY_TAKEN){
-      return TAKEN;
-   }else{
-      return NOT_TAKEN;
+   void GetStorage(std::vector<StorageComponent>& parts) const {
+      // each BHT entry holds a row index of the PHT
+      AddStorage(parts, "BHT", (UINT64)size_bht * CeilLog2(pht_row));
+      AddStorage(parts, "PHT", (UINT64)pht_col * pht_row * 2);
    }
-}
 
-void UpdatePredictor_2level(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
-   UINT32 PHT_idx1 = (PC % PHT_COL);
-   UINT32 BHT_idx = (PC >> 3) % SIZE_BHT;
-   UINT32 PHT_idx2 = (BHT[BHT_idx] % PHT_ROW);
-   // update entry in BHT
-   BHT[BHT_idx] = ((BHT[BHT_idx] << 1) | resolveDir) % PHT_ROW;
-   
-   // update prediction in PHT
-   if(resolveDir == TAKEN && PHT[PHT_idx1][PHT_idx2] != STRONGLY_TAKEN){
-      PHT[PHT_idx1][PHT_idx2]++;    
-   }else if(resolveDir == NOT_TAKEN && PHT[PHT_idx1][PHT_idx2] != STRONGLY_NOT_TAKEN){
-      PHT[PHT_idx1][PHT_idx2]--;
+   void SaveState(StateWriter& out) const {
+      out.Put((UINT64)BHT.size());
+      out.PutArray(BHT.data(), BHT.size());
+      PHT.Save(out);
+   }
+
+   bool LoadState(StateReader& in) {
+      UINT64 n;
+      if(!in.Get(n) || n != BHT.size()) return false;
+      return in.GetArray(BHT.data(), BHT.size()) && PHT.Load(in);
    }
+};
+
+// spec: 2level[:bht_entries[:pht_col[:pht_row]]]
+static Predictor* Create_2level(const std::vector<UINT32>& args) {
+   if(args.size() > 3) return NULL;
+   UINT32 bht = args.size() > 0 ? args[0] : SIZE_BHT;
+   UINT32 col = args.size() > 1 ? args[1] : PHT_COL;
+   UINT32 row = args.size() > 2 ? args[2] : PHT_ROW;
+   if(bht == 0 || col == 0 || row == 0) return NULL;
+   if(bht > MAX_TABLE_ENTRIES || (UINT64)col * row > MAX_TABLE_ENTRIES) return NULL;
+   return new Predictor_2level(bht, col, row);
 }
 
 /////////////////////////////////////////////////////////////
 // openend
 /////////////////////////////////////////////////////////////
-// Table configuration parameters
-#define NSTEP 4
-#define NDIFF 3
+// Table configuration parameters. The geometry (bank count, table sizes,
+// tag widths, history lengths) lives in the TageConfig structs below.
 #define NALLOC 5
-#define NHIST 20
 #define NSTAT 3
 #define MSTAT 3
 #define TSTAT (NSTAT+MSTAT+1)
 #define CBIT 2
 #define UBIT 3
-// History length settings
-#define MAXHIST 880
+#define UEBIT 5 // aging stamp kept with each useful counter, see GTable
 // Tage parameters
 #define HYSTSHIFT 2
-#define LOGB 13
-#define LOGG  9
 // Statistic corrector parameters
-#define LOGC 11
 #define CBANK 3
 #define CSTAT 6
 // Maximum history width
@@ -139,6 +216,8 @@ public:
    void setmax(){ ctr = MAX; }
    void setmin(){ ctr = MIN; }
    void write(int32_t v) { ctr = v; }
+   void save(StateWriter& out) const { out.Put(ctr); }
+   bool load(StateReader& in) { return in.Get(ctr); }
    void add(int32_t d) {
       ctr = ctr + d;
       if (ctr > MAX) ctr = MAX;
@@ -167,79 +246,203 @@ public:
 //////////////////////////////////////////////////////
 // history managemet data structure
 //////////////////////////////////////////////////////
+// Smallest power of two (at least 64) that holds history bits 0..maxhist
+constexpr int HistBufBits(int maxhist, int bits = 64) {
+  return bits > maxhist ? bits : HistBufBits(maxhist, 2 * bits);
+}
+
+template <int BITS>
 class GlobalHistoryBuffer {
 private:
-  bool bhr[MAXHIST];
+  // Bit-packed ring buffer. History bit n lives at ring position
+  // (head + n), so a push only moves head and writes one bit. It must
+  // predict exactly like the shift register it replaced; "sweep -check
+  // regress.expected regress.bpt" compares against that code's counts.
+  uint64_t bhr[BITS / 64];
+
+protected:
+  int head;
 
 public:
-  void init() { for(int i=0; i<MAXHIST; i++) { bhr[i] = false; } }
+  void init() {
+    for(int i=0; i<BITS/64; i++) { bhr[i] = 0; }
+    head = 0;
+  }
   void push(bool taken) {
-    for(int i=MAXHIST-2; i>=0; i--) { bhr[i+1] = bhr[i]; }
-    bhr[0] = taken;
+    head = (head - 1) & (BITS - 1);
+    uint64_t mask = 1ULL << (head & 63);
+    bhr[head >> 6] = (bhr[head >> 6] & ~mask) | (taken ? mask : 0);
+  }
+  bool read(int n) {
+    int pos = (head + n) & (BITS - 1);
+    return (bhr[pos >> 6] >> (pos & 63)) & 1;
+  }
+  void save(StateWriter& out) const {
+    out.PutArray(bhr, BITS/64);
+    out.Put(head);
+  }
+  bool load(StateReader& in) {
+    return in.GetArray(bhr, BITS/64) && in.Get(head);
   }
-  bool read(int n) { return bhr[n]; }
 };
 
-class GlobalHistory : public GlobalHistoryBuffer {
+//////////////////////////////////////////////////////
+// Folded history update
+//////////////////////////////////////////////////////
+// Every folded history register takes the same step when a bit is pushed:
+// shift in the new bit, xor out the bit leaving its window at OUTPOINT and
+// fold the overflow back in. The registers are lanes of flat arrays, so
+// the step runs over all of them at once; the AVX2 version does eight
+// lanes per instruction. It is picked once like the tag match (or
+// TAGE_FOLD=scalar|avx2).
+#define FOLDLANES 8 // lane arrays are padded to a whole AVX2 vector
+
+typedef void (*FoldUpdateFn)(uint32_t *comp, const uint32_t *out, const uint32_t *outpoint,
+                             const uint32_t *clength, const uint32_t *mask, int n, uint32_t in);
+
+static void FoldUpdateScalar(uint32_t *comp, const uint32_t *out, const uint32_t *outpoint,
+                             const uint32_t *clength, const uint32_t *mask, int n, uint32_t in) {
+  for (int i=0; i<n; i++) {
+    uint32_t c = (comp[i] << 1) | in;
+    c ^= out[i] << outpoint[i];
+    c ^= c >> clength[i];
+    comp[i] = c & mask[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void FoldUpdateAVX2(uint32_t *comp, const uint32_t *out, const uint32_t *outpoint,
+                           const uint32_t *clength, const uint32_t *mask, int n, uint32_t in) {
+  __m256i vin = _mm256_set1_epi32(in);
+  for (int i=0; i<n; i+=FOLDLANES) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(comp + i));
+    c = _mm256_or_si256(_mm256_slli_epi32(c, 1), vin);
+    c = _mm256_xor_si256(c, _mm256_sllv_epi32(_mm256_loadu_si256((const __m256i *)(out + i)),
+                                              _mm256_loadu_si256((const __m256i *)(outpoint + i))));
+    c = _mm256_xor_si256(c, _mm256_srlv_epi32(c, _mm256_loadu_si256((const __m256i *)(clength + i))));
+    c = _mm256_and_si256(c, _mm256_loadu_si256((const __m256i *)(mask + i)));
+    _mm256_storeu_si256((__m256i *)(comp + i), c);
+  }
+}
+#endif
+
+static FoldUpdateFn SelectFoldUpdate() {
+  const char *force = getenv("TAGE_FOLD");
+  if (force && strcmp(force, "scalar") == 0) return FoldUpdateScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FoldUpdateAVX2;
+#endif
+  return FoldUpdateScalar;
+}
+
+static const FoldUpdateFn FoldUpdate = SelectFoldUpdate();
+
+// Lanes 0..NHIST-1 fold each bank's history to its index width, the next
+// three groups of NHIST to its tag width, tag width - 1 and tag width - 2,
+// and the last NSTAT lanes feed the statistical corrector.
+template <int NHIST, int MAXHIST>
+class GlobalHistory : public GlobalHistoryBuffer<HistBufBits(MAXHIST)> {
 private:
-  class FoldedHistory {
-  public:
-    unsigned comp;
-    int CLENGTH;
-    int OLENGTH;
-    int OUTPOINT;
-    
-    void init (int original_length, int compressed_length) {
-      comp = 0;
-      OLENGTH = original_length;
-      CLENGTH = compressed_length;
-      OUTPOINT = OLENGTH % CLENGTH;
-    }
-    
-    void update (GlobalHistoryBuffer *h) {
-      comp = (comp << 1) | h->read(0);
-      comp ^= (h->read(OLENGTH) ? 1 : 0) << OUTPOINT;
-      comp ^= (comp >> CLENGTH);
-      comp &= (1 << CLENGTH) - 1;
-    }
+  enum {
+    NFOLD = 4 * NHIST + NSTAT,
+    NLANES = (NFOLD + FOLDLANES - 1) / FOLDLANES * FOLDLANES,
+    CLANE = 4 * NHIST // first corrector lane
   };
-  FoldedHistory ch_i[NHIST];
-  FoldedHistory ch_c[NSTAT];
-  FoldedHistory ch_t[3][NHIST];
+  uint32_t comp[NLANES];     // folded value
+  uint32_t out[NLANES];      // bit leaving the window on this push
+  uint32_t outpoint[NLANES]; // OLENGTH % CLENGTH
+  uint32_t clength[NLANES];  // folded width
+  uint32_t mask[NLANES];     // (1 << CLENGTH) - 1, 0 for padding lanes
+  int olength[NLANES];       // history length folded
   
+  void initLane(int lane, int original_length, int compressed_length) {
+    comp[lane] = 0;
+    olength[lane] = original_length;
+    clength[lane] = compressed_length;
+    outpoint[lane] = original_length % compressed_length;
+    mask[lane] = (1 << compressed_length) - 1;
+  }
+
 public:
   void updateFoldedHistory() {
-    for (int i=0; i<NSTAT; i++) {
-      ch_c[i].update(this);
-    }
+    // the index and tag folds of a bank share its history length
+    #pragma GCC unroll 32
     for (int i = 0; i < NHIST; i++) {
-      ch_i[i].update(this);
-      ch_t[0][i].update(this);
-      ch_t[1][i].update(this);
-      ch_t[2][i].update(this);
+      uint32_t o = this->read(olength[i]);
+      out[i] = out[NHIST + i] = out[2*NHIST + i] = out[3*NHIST + i] = o;
+    }
+    for (int i=CLANE; i<NFOLD; i++) {
+      out[i] = this->read(olength[i]);
     }
+    FoldUpdate(comp, out, outpoint, clength, mask, NLANES, this->read(0));
   }
-  void setup(int *m, int *l, int *t, int *c, int size) {
+  void setup(const int *m, const int *l, const int *t, const int *c, int size) {
+    for (int i=0; i<NLANES; i++) {
+      comp[i] = out[i] = outpoint[i] = clength[i] = mask[i] = 0;
+      olength[i] = 0;
+    }
     for (int i = 0; i < NHIST; i++) {
-      ch_i[i].init(m[i], l[i]);
-      ch_t[0][i].init(m[i], t[i]);
-      ch_t[1][i].init(m[i], t[i] - 1);
-      ch_t[2][i].init(m[i], t[i] - 2);
+      initLane(i, m[i], l[i]);
+      initLane(NHIST + i, m[i], t[i]);
+      initLane(2*NHIST + i, m[i], t[i] - 1);
+      initLane(3*NHIST + i, m[i], t[i] - 2);
     }
     for (int i=0; i<NSTAT; i++) {
-      ch_c[i].init(c[i], size);
+      initLane(CLANE + i, c[i], size);
+    }
+  }
+  uint32_t gidx(int n) { return comp[n]; }
+  uint32_t gtag(int n) { return comp[NHIST+n]^(comp[2*NHIST+n]<<1)^(comp[3*NHIST+n]<<2); }
+  uint32_t cgidx(int n) { return comp[CLANE+n]; }
+  int foldedBits() const {
+    int bits = 0;
+    for (int i=0; i<NFOLD; i++) {
+      bits += clength[i];
     }
+    return bits;
   }
-  uint32_t gidx(int n, int length, int clength) { return ch_i[n].comp;}
-  uint32_t gtag(int n, int length, int clength) { return ch_t[0][n].comp^(ch_t[1][n].comp<<1)^(ch_t[2][n].comp<<2); }
-  uint32_t cgidx(int n, int length, int clength) { return ch_c[n].comp; } 
   void update(bool taken) {
-    push(taken);
+    this->push(taken);
     updateFoldedHistory();
   }
+
+  // Ring position and folds at one point in time. The ring bits are not
+  // copied: pushes only overwrite bits past the oldest one in use, so a
+  // restore is exact as long as at most BITS - MAXHIST - 1 bits were
+  // pushed since the checkpoint was taken.
+  struct Checkpoint {
+    int head;
+    uint32_t comp[NFOLD];
+  };
+  void checkpoint(Checkpoint& cp) const {
+    cp.head = this->head;
+    memcpy(cp.comp, comp, sizeof(cp.comp));
+  }
+  void restore(const Checkpoint& cp) {
+    this->head = cp.head;
+    memcpy(comp, cp.comp, sizeof(cp.comp));
+  }
+  void saveCheckpoint(StateWriter& out, const Checkpoint& cp) const {
+    out.Put(cp.head);
+    out.PutArray(cp.comp, NFOLD);
+  }
+  bool loadCheckpoint(StateReader& in, Checkpoint& cp) const {
+    return in.Get(cp.head) && in.GetArray(cp.comp, NFOLD);
+  }
+
+  void save(StateWriter& out) const {
+    GlobalHistoryBuffer<HistBufBits(MAXHIST)>::save(out);
+    out.PutArray(comp, NFOLD);
+  }
+  bool load(StateReader& in) {
+    return GlobalHistoryBuffer<HistBufBits(MAXHIST)>::load(in) && in.GetArray(comp, NFOLD);
+  }
 };
 
 
+
 class LocalHistory {
   uint32_t lht[LHTSIZE];
   uint32_t getIndex(uint32_t pc) {
@@ -259,8 +462,23 @@ public:
     lht[getIndex(pc)] &= (1<<LHISTWIDTH) - 1;
   }
   
+  uint32_t get(uint32_t pc) {
+    return lht[getIndex(pc)];
+  }
+
+  void set(uint32_t pc, uint32_t h) {
+    lht[getIndex(pc)] = h;
+  }
+
+  void save(StateWriter& out) const { out.PutArray(lht, LHTSIZE); }
+  bool load(StateReader& in) { return in.GetArray(lht, LHTSIZE); }
+
   uint32_t read(uint32_t pc, int length, int clength) {
-    uint32_t h = lht[getIndex(pc)];
+    return fold(get(pc), length, clength);
+  }
+
+  // folds the newest length bits of h down to clength bits
+  static uint32_t fold(uint32_t h, int length, int clength) {
     h &= (1 << length) - 1;
     
     uint32_t v = 0;
@@ -306,51 +524,253 @@ public:
       pred[getIndex(pc)] = inter >> 1;
       hyst[getIndex(pc)>>HSFT] = inter & 1;
   }
+
+   void save(StateWriter& out) const {
+      out.PutBits(pred, 1 << BITS);
+      out.PutBits(hyst, 1 << (BITS - HSFT));
+   }
+
+   bool load(StateReader& in) {
+      return in.GetBits(pred, 1 << BITS) && in.GetBits(hyst, 1 << (BITS - HSFT));
+   }
 };
 
 //////////////////////////////////////////////////////////
 // Global component for TAGE predictor
 // This predictor is derived from CBP3 ISL-TAGE
 //////////////////////////////////////////////////////////
-class GEntry {
+// Entries are kept as separate narrow tag, counter and useful-bit arrays
+// instead of an array of structs, so the tag probe in predict() only
+// touches tag bytes.
+//
+// Useful counters age lazily. Instead of decrementing every entry when
+// TICK saturates, the predictor bumps a shared aging epoch, and each
+// entry keeps the low UEBIT bits of the epoch of its last write above its
+// counter. Reading subtracts the epochs since then, saturating at 0. So
+// that the stamp never wraps, every aging also restamps the next
+// 1/UAGE_SLICE of the table with its current value, which visits each
+// entry at least once every 2^UEBIT - 1 agings. The result is exactly
+// what decrementing every counter at once would have left.
+#define UMASK ((1 << UBIT) - 1)
+#define UEMASK ((1 << UEBIT) - 1)
+#define UAGE_SLICE UEMASK
+
+class GTable {
 public:
-  uint32_t tag;
-  SCounter<CBIT> c;
-  UCounter<UBIT> u;
-  
-  GEntry () {
-    tag = 0;
-    c.write(0);
-    u.write(0);
+  uint16_t *tag;
+  int8_t *c;  // SCounter<CBIT> range
+  uint8_t *u; // UCounter<UBIT> value, aging stamp in the upper UEBIT bits
+  const uint32_t *epoch; // current aging epoch, shared by all banks
+  int size;
+  int restamp; // next entry the aging restamps
+
+  void alloc(int entries, const uint32_t *aging) {
+    tag = new uint16_t[entries]();
+    c = new int8_t[entries]();
+    u = new uint8_t[entries]();
+    epoch = aging;
+    size = entries;
+    restamp = 0;
   }
-  
-  void init(uint32_t t, bool taken, int uval=0) {
-    tag = t;
-    c.write(taken ? 0 : -1);
-    u.write(uval);
+
+  void release() {
+    delete [] tag;
+    delete [] c;
+    delete [] u;
   }
-  
-  bool newalloc() {
-    return (abs(2*c.read() + 1) == 1);
+
+  void init(int i, uint32_t t, bool taken, int uval=0) {
+    tag[i] = t;
+    c[i] = taken ? 0 : -1;
+    uset(i, uval);
+  }
+
+  bool pred(int i) { return c[i] >= 0; }
+
+  bool newalloc(int i) {
+    return (abs(2*c[i] + 1) == 1);
+  }
+
+  void cupdate(int i, bool taken) {
+    if (taken) {
+      if (c[i] < (1<<(CBIT-1))-1) c[i]++;
+    } else {
+      if (c[i] > -(1<<(CBIT-1))) c[i]--;
+    }
+  }
+
+  int uget(int i) const {
+    int age = (*epoch - (u[i] >> UBIT)) & UEMASK;
+    int v = u[i] & UMASK;
+    return age >= v ? 0 : v - age;
+  }
+  void uset(int i, int v) {
+    u[i] = v | ((*epoch & UEMASK) << UBIT);
+  }
+  void usetmax(int i) { uset(i, UMASK); }
+
+  // Called on the table's first bank just before the epoch advances
+  void age() {
+    int n = (size + UAGE_SLICE - 1) / UAGE_SLICE;
+    for (int k=0; k<n; k++) {
+      uset(restamp, uget(restamp));
+      if (++restamp == size) restamp = 0;
+    }
+  }
+
+  // u is saved with the aging applied, so checkpoints hold plain counters
+  void save(StateWriter& out, int size) const {
+    out.PutArray(tag, size);
+    out.PutArray(c, size);
+    for (int i=0; i<size; i++) {
+      out.Put((uint8_t)uget(i));
+    }
+  }
+
+  bool load(StateReader& in, int size) {
+    if (!(in.GetArray(tag, size) && in.GetArray(c, size) && in.GetArray(u, size))) return false;
+    for (int i=0; i<size; i++) {
+      if (u[i] > UMASK) return false;
+      uset(i, u[i]);
+    }
+    restamp = 0;
+    return true;
   }
 };
 
+//////////////////////////////////////////////////////////
+// Tag match across all TAGE banks
+//////////////////////////////////////////////////////////
+// Compares TAGLANES probed tags against the computed tags and returns a
+// mask with bit i set when lane i matches; callers mask off lanes beyond
+// their bank count. The vector versions are picked once from the CPU
+// features (or TAGE_TAGMATCH=scalar|sse2|avx2) and all return the same
+// mask.
+#define TAGLANES 32 // bank count limit, a whole number of AVX2 vectors
+
+typedef uint32_t (*TagMatchFn)(const uint16_t *tags, const uint16_t *want);
+
+static uint32_t TagMatchScalar(const uint16_t *tags, const uint16_t *want) {
+  uint32_t mask = 0;
+  for (int i=0; i<TAGLANES; i++) {
+    mask |= (uint32_t)(tags[i] == want[i]) << i;
+  }
+  return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t TagMatchSSE2(const uint16_t *tags, const uint16_t *want) {
+  uint32_t mask = 0;
+  for (int i=0; i<TAGLANES; i+=16) {
+    __m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(tags + i)),
+                                 _mm_loadu_si128((const __m128i *)(want + i)));
+    __m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(tags + i + 8)),
+                                 _mm_loadu_si128((const __m128i *)(want + i + 8)));
+    mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+static uint32_t TagMatchAVX2(const uint16_t *tags, const uint16_t *want) {
+  __m256i lo = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)tags),
+                                  _mm256_loadu_si256((const __m256i *)want));
+  __m256i hi = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(tags + 16)),
+                                  _mm256_loadu_si256((const __m256i *)(want + 16)));
+  // packs works per 128-bit lane; put the four 8-bank groups back in order
+  __m256i eq = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+  return (uint32_t)_mm256_movemask_epi8(eq);
+}
+#endif
+
+static TagMatchFn SelectTagMatch() {
+  const char *force = getenv("TAGE_TAGMATCH");
+  if (force && strcmp(force, "scalar") == 0) return TagMatchScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (force && strcmp(force, "sse2") == 0) return TagMatchSSE2;
+  if (__builtin_cpu_supports("avx2")) return TagMatchAVX2;
+  if (__builtin_cpu_supports("sse2")) return TagMatchSSE2;
+#endif
+  return TagMatchScalar;
+}
+
+static const TagMatchFn TagMatch = SelectTagMatch();
+
 //////////////////////////////////////////////////////////
 // Put it all together.
 // The predictor main component class
 //////////////////////////////////////////////////////////
-// Configuration of table sharing strategy
-static const int STEP[NSTEP+1] = {0, NDIFF, NHIST/2, NHIST};
-class my_predictor {
+// Each configuration fixes the geometry at compile time, so every
+// tage_predictor<CFG> gets constant bank loop bounds and table masks.
+// Banks STEP[s]..STEP[s+1]-1 share the table of bank STEP[s].
+//
+// TageConfigDefault is the tuned lab configuration. The other variants
+// rescale its global tables (and bimodal/corrector sizes) to fit 8 KB,
+// 32 KB and 64 KB of predictor state. TageConfigRuntime keeps the
+// default bank count, sharing and history limit but lets each instance
+// resize its tables, tags and history lengths, for table-size sweeps
+// between the compiled points.
+struct TageConfigDefault {
+  static const bool RUNTIME = false; // logg/TB/m come from the instance
+  static const int NHIST = 20;
+  static const int NSTEP = 3;
+  static const int LOGB = 13;
+  static const int LOGC = 11;
+  static const int MAXHIST = 880;
+  // Configuration of table sharing strategy
+  static constexpr int STEP[NSTEP+1] = {0, 3, NHIST/2, NHIST};
   // Tag width and index width of TAGE predictor
-  int TB[NHIST] = {8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10};
-  int logg[NHIST] = {10, 7, 7, 11, 8, 8, 8, 8, 8, 8, 10, 7, 7, 7, 7, 7, 7, 7, 7, 7};
-  
+  static constexpr int TB[NHIST] = {8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10};
+  static constexpr int logg[NHIST] = {10, 7, 7, 11, 8, 8, 8, 8, 8, 8, 10, 7, 7, 7, 7, 7, 7, 7, 7, 7};
   // History length for TAGE predictor
-  int m[NHIST] = {5, 7, 9, 11, 15, 19, 26, 34, 44, 58, 76, 100, 131, 172, 226, 296, 389, 511, 670, 880};
-  int l[NHIST] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 3, 4, 6, 8, 11, 14};
-  int p[NHIST] = {5, 7, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8};
-  
+  static constexpr int m[NHIST] = {5, 7, 9, 11, 15, 19, 26, 34, 44, 58, 76, 100, 131, 172, 226, 296, 389, 511, 670, 880};
+  static constexpr int l[NHIST] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 3, 4, 6, 8, 11, 14};
+  static constexpr int p[NHIST] = {5, 7, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8};
+};
+constexpr int TageConfigDefault::STEP[];
+constexpr int TageConfigDefault::TB[];
+constexpr int TageConfigDefault::logg[];
+constexpr int TageConfigDefault::m[];
+constexpr int TageConfigDefault::l[];
+constexpr int TageConfigDefault::p[];
+
+struct TageConfig8KB : TageConfigDefault {
+  static const int LOGB = 12;
+  static constexpr int logg[NHIST] = {9, 6, 6, 10, 7, 7, 7, 7, 7, 7, 9, 6, 6, 6, 6, 6, 6, 6, 6, 6};
+};
+constexpr int TageConfig8KB::logg[];
+
+struct TageConfig32KB : TageConfigDefault {
+  static const int LOGC = 10;
+  static constexpr int logg[NHIST] = {12, 9, 9, 13, 10, 10, 10, 10, 10, 10, 12, 9, 9, 9, 9, 9, 9, 9, 9, 9};
+};
+constexpr int TageConfig32KB::logg[];
+
+struct TageConfig64KB : TageConfigDefault {
+  static const int LOGB = 14;
+  static constexpr int logg[NHIST] = {13, 10, 10, 14, 11, 11, 11, 11, 11, 11, 13, 10, 10, 10, 10, 10, 10, 10, 10, 10};
+};
+constexpr int TageConfig64KB::logg[];
+
+struct TageConfigRuntime : TageConfigDefault {
+  static const bool RUNTIME = true;
+};
+
+template <class CFG>
+class tage_predictor : public Predictor {
+  enum {
+    NHIST = CFG::NHIST,
+    NSTEP = CFG::NSTEP,
+    LOGB = CFG::LOGB,
+    LOGC = CFG::LOGC,
+    MAXHIST = CFG::MAXHIST,
+    // in-flight branches whose history checkpoints the ring buffer keeps
+    MAXDELAY = HistBufBits(MAXHIST) - MAXHIST - 2
+  };
+  static_assert(NHIST <= TAGLANES, "tag match handles at most TAGLANES banks");
+
   // History length for statistical corrector predictors
   int cg[NSTAT] = {2, 5, 13};
   int cp[NSTAT] = {2, 5, 8};
@@ -360,6 +780,17 @@ class my_predictor {
   uint32_t CI[TSTAT];
   uint32_t GI[NHIST];
   uint32_t GTAG[NHIST];
+  uint16_t PTAG[TAGLANES]; // probed tags, padded for the vector tag match
+  uint16_t WTAG[TAGLANES]; // GTAG narrowed to the table's tag width
+
+  // Hash terms that depend only on the histories. hashHistories()
+  // refreshes them once per branch, so predict() only mixes in the PC.
+  uint32_t FP[NHIST][1<<PHISTWIDTH]; // F(phist, p[i], i, logg[i]) for every phist
+  uint32_t FC[NSTAT][1<<PHISTWIDTH]; // F(phist, cp[i], i, LOGC-CBANK) for every phist
+  uint32_t HIDX[NHIST]; // global history index fold ^ path hash
+  uint32_t HTAG[NHIST]; // global history tag folds
+  uint32_t HCI[NSTAT];  // statistical corrector fold ^ path hash
+  int GSHIFT[NHIST];    // pc shift of the TAGE index hash
   
   // Intermediate prediction result for TAGE
   bool HitPred, AltPred, TagePred;
@@ -368,6 +799,8 @@ class my_predictor {
   // Intermediate prediction result for statistical corrector predictor
   bool SCPred;
   int SCSum;
+
+  PredictionProvider Provider; // component behind the final prediction
   
   // Intermediate prediction result for loop predictor
   bool loopPred;
@@ -375,11 +808,11 @@ class my_predictor {
 
   // Prediction Tables
   Bimodal<LOGB,HYSTSHIFT> btable; // bimodal table
-  GEntry *gtable[NHIST]; // global components
+  GTable gtable[NHIST]; // global components, banks of a group share arrays
   SCounter<CSTAT> *ctable[2]; // statistical corrector predictor table
   
   // Branch Histories
-  GlobalHistory ghist; // global history register
+  GlobalHistory<NHIST, MAXHIST> ghist; // global history register
   LocalHistory lhist; // local history table
   uint32_t phist; // path history register
 
@@ -387,28 +820,80 @@ class my_predictor {
   UCounter<UC_WIDTH> UC; // statistical corrector predictor tracking counter
   SCounter<UT_WIDTH> UT; // statistical corrector predictor threshold counter
   UCounter<TK_WIDTH> TICK; // tick counter for reseting u bit of global entryies
+  uint32_t uepoch; // u aging epoch, see GTable
   SCounter<UA_WIDTH> UA[NSTEP+1][NSTEP+1]; // newly allocated entry counter
-private:
+
+  // Speculative history mode. With a resolve delay of N, histories are
+  // pushed with the predicted direction at predict time and the tables
+  // are trained N branches later, from the indices and intermediate
+  // results saved with the prediction. The trace only holds the correct
+  // path, and the branches after a misprediction are fetched once it
+  // resolves, so a misprediction drains the older in-flight branches in
+  // order, then rolls the histories back to its checkpoint and pushes
+  // the real outcome.
+  struct InFlight {
+    uint32_t pc;
+    bool histDir, taken; // direction in the history, resolved direction
+    uint32_t GI[NHIST], GTAG[NHIST], CI[TSTAT];
+    bool HitPred, AltPred, TagePred, SCPred;
+    int HitBank, AltBank, TageBank, SCSum;
+    typename GlobalHistory<NHIST, MAXHIST>::Checkpoint gcp;
+    uint32_t phist, lhist; // before this branch was pushed
+  };
+  int resolveDelay;
+  std::vector<InFlight> inflight; // ring of resolveDelay+1 entries
+  int oldest, numInFlight;
+
+  // Indices and intermediate results of the block of the last
+  // PredictBlock, kept for UpdateBlock
+  std::vector<InFlight> block;
+
+  // Index width, tag width and history length of every bank. Compiled
+  // configurations read the constants of CFG instead, so their masks
+  // stay constant.
+  int rlogg[NHIST], rtb[NHIST], rm[NHIST];
+  int logg(int i) const { return CFG::RUNTIME ? rlogg[i] : CFG::logg[i]; }
+  int tb(int i) const { return CFG::RUNTIME ? rtb[i] : CFG::TB[i]; }
 public:
-my_predictor (void) {
+static const int MAX_RESOLVE_DELAY = MAXDELAY;
+
+// The optional geometry arguments only apply to TageConfigRuntime:
+// logg_delta and tb_delta are added to every logg[] and TB[] entry, and
+// hist_pct scales the history lengths m[] (capped at MAXHIST).
+tage_predictor (int delay = 0, int logg_delta = 0, int tb_delta = 0, int hist_pct = 100)
+  : resolveDelay(delay), inflight(delay + 1), oldest(0), numInFlight(0) {
+  assert(delay >= 0 && delay <= MAXDELAY);
+  assert(CFG::RUNTIME || (logg_delta == 0 && tb_delta == 0 && hist_pct == 100));
+  for (int i=0; i<NHIST; i++) {
+    rlogg[i] = CFG::logg[i] + logg_delta;
+    rtb[i] = CFG::TB[i] + tb_delta;
+    rm[i] = CFG::m[i] * hist_pct / 100;
+    if (i > 0 && rm[i] <= rm[i-1]) rm[i] = rm[i-1] + 1;
+    if (rm[i] < 1) rm[i] = 1;
+    if (rm[i] > MAXHIST) rm[i] = MAXHIST;
+  }
   // Setup misc registers
   UC.write(0);
   UT.write(0);
   TICK.write(0);
+  uepoch = 0;
 
   for(int i=0; i<NSTEP+1; i++) {
     for(int j=0; j<NSTEP+1; j++) {
       UA[i][j].write(0);
     }
   }
+  for(int i=0; i<TAGLANES; i++) {
+    PTAG[i] = WTAG[i] = 0;
+  }
 
   // Setup global components
   for(int i=0; i<NSTEP; i++) {
-    gtable[STEP[i]] = new GEntry[1 << logg[STEP[i]]];
+    gtable[CFG::STEP[i]].alloc(1 << logg(CFG::STEP[i]), &uepoch);
   }
   for(int i=0; i<NSTEP; i++) {
-    for (int j=STEP[i]+1; j<STEP[i+1]; j++) {
-      gtable[j] = gtable[STEP[i]];
+    for (int j=CFG::STEP[i]+1; j<CFG::STEP[i+1]; j++) {
+      gtable[j] = gtable[CFG::STEP[i]];
     }
   }
   btable.init();
@@ -424,7 +909,191 @@ my_predictor (void) {
   phist = 0;
   ghist.init();
   lhist.init();
-  ghist.setup(m, logg, TB, cg, LOGC-CBANK);
+  ghist.setup(rm, rlogg, rtb, cg, LOGC-CBANK);
+
+  // Tabulate the path history hashes and the per-bank pc shifts
+  for (int i=0; i<NHIST; i++) {
+    for (int h=0; h<(1<<PHISTWIDTH); h++) {
+      FP[i][h] = F(h, CFG::p[i], i, logg(i));
+    }
+    GSHIFT[i] = abs (logg(i) - i) + 1;
+  }
+  for (int i=0; i<NSTAT; i++) {
+    for (int h=0; h<(1<<PHISTWIDTH); h++) {
+      FC[i][h] = F(h, cp[i], i, LOGC-CBANK);
+    }
+  }
+  hashHistories();
+}
+
+~tage_predictor (void) {
+  for(int i=0; i<NSTEP; i++) {
+    gtable[CFG::STEP[i]].release();
+  }
+  delete [] ctable[0];
+  delete [] ctable[1];
+}
+
+bool GetPrediction(UINT32 PC) {
+  if (resolveDelay == 0) {
+    return predict(PC);
+  }
+  bool pred = predict(PC);
+  InFlight &e = inflight[(oldest + numInFlight) % (resolveDelay + 1)];
+  numInFlight++;
+  e.pc = PC;
+  e.histDir = pred;
+  e.taken = pred;
+  saveResults(e);
+  ghist.checkpoint(e.gcp);
+  e.phist = phist;
+  e.lhist = lhist.get(PC);
+  pushHistory(PC, pred);
+  return pred;
+}
+
+PredictionProvider GetProvider() const {
+  return Provider;
+}
+
+void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+  if (resolveDelay == 0) {
+    update(PC, resolveDir, branchTarget);
+    return;
+  }
+  InFlight &e = inflight[(oldest + numInFlight - 1) % (resolveDelay + 1)];
+  e.taken = resolveDir;
+  if (e.histDir != e.taken) {
+    while (numInFlight > 0) resolve();
+  } else if (numInFlight > resolveDelay) {
+    resolve();
+  }
+}
+
+// Every branch of a block is predicted from the histories at its start,
+// so they share HIDX and HTAG. The banks are the outer loop: the index
+// and tag of all branches are hashed together before any table is read.
+// Branches still in flight are resolved first, as their outcomes are
+// already known.
+void PredictBlock(const UINT32* PCs, int n, bool* predDirs) {
+  while (numInFlight > 0) resolve();
+  if ((int)block.size() < n) block.resize(n);
+  for (int k=0; k<n; k++) {
+    block[k].lhist = lhist.get(PCs[k]);
+  }
+  for (int i=0; i<NHIST; i++) {
+    for (int k=0; k<n; k++) {
+      block[k].GI[i] = gindex(PCs[k], i, block[k].lhist);
+      block[k].GTAG[i] = gtag(PCs[k], i);
+    }
+  }
+  for (int k=0; k<n; k++) {
+    shareIndices(block[k].GI);
+    memcpy(GI, block[k].GI, sizeof(GI));
+    memcpy(GTAG, block[k].GTAG, sizeof(GTAG));
+    predDirs[k] = lookup(PCs[k]);
+    saveResults(block[k]);
+  }
+}
+
+void UpdateBlock(const UINT32* PCs, int n, const bool* resolveDirs,
+                 const bool* predDirs, const UINT32* branchTargets) {
+  for (int k=0; k<n; k++) {
+    loadResults(block[k]);
+    train(PCs[k], resolveDirs[k]);
+    pushHistory(PCs[k], resolveDirs[k]);
+  }
+}
+
+void GetStorage(std::vector<StorageComponent>& parts) const {
+  // bimodal prediction bits, hysteresis shared by 1<<HYSTSHIFT entries
+  AddStorage(parts, "bimodal", (1ULL << LOGB) + (1ULL << (LOGB - HYSTSHIFT)));
+  // one tag, prediction counter and useful counter per shared entry; the
+  // aging stamp only lets the simulator age lazily and is not hardware
+  UINT64 gbits = 0;
+  for (int s=0; s<NSTEP; s++) {
+    int width = 0;
+    for (int i=CFG::STEP[s]; i<CFG::STEP[s+1]; i++) {
+      if (tb(i) > width) width = tb(i);
+    }
+    gbits += (1ULL << logg(CFG::STEP[s])) * (width + CBIT + UBIT);
+  }
+  AddStorage(parts, "gtable", gbits);
+  AddStorage(parts, "ctable", 2ULL * (1 << LOGC) * CSTAT);
+  AddStorage(parts, "lhist", LHTSIZE * LHISTWIDTH);
+  // the oldest bit MAXHIST is still needed to retire it from the folds
+  AddStorage(parts, "ghist", MAXHIST + 1);
+  AddStorage(parts, "folded", ghist.foldedBits());
+  AddStorage(parts, "phist", PHISTWIDTH);
+  AddStorage(parts, "UC", UC_WIDTH);
+  AddStorage(parts, "UT", UT_WIDTH);
+  AddStorage(parts, "TICK", TK_WIDTH);
+  AddStorage(parts, "UA", (NSTEP+1) * (NSTEP+1) * UA_WIDTH);
+  if (resolveDelay > 0) {
+    // per in-flight branch: folds, path history, local history and ring
+    // position to repair from, plus the extra ring bits it keeps alive
+    UINT64 cp = ghist.foldedBits() + PHISTWIDTH + LHISTWIDTH + CeilLog2(HistBufBits(MAXHIST)) + 1;
+    AddStorage(parts, "checkpoints", (UINT64)(resolveDelay + 1) * cp);
+  }
+}
+
+// Saves the tables once per shared group and the SC counters narrowed to
+// a byte; the index and tag hashes are recomputed on load.
+void SaveState(StateWriter& out) const {
+  btable.save(out);
+  for (int s=0; s<NSTEP; s++) {
+    gtable[CFG::STEP[s]].save(out, 1 << logg(CFG::STEP[s]));
+  }
+  for (int t=0; t<2; t++) {
+    for (int i=0; i<(1<<LOGC); i++) {
+      out.Put((int8_t)ctable[t][i].read());
+    }
+  }
+  ghist.save(out);
+  lhist.save(out);
+  out.Put(phist);
+  UC.save(out);
+  UT.save(out);
+  TICK.save(out);
+  for (int i=0; i<NSTEP+1; i++) {
+    for (int j=0; j<NSTEP+1; j++) {
+      UA[i][j].save(out);
+    }
+  }
+  out.Put(numInFlight);
+  for (int k=0; k<numInFlight; k++) {
+    saveInFlight(out, inflight[(oldest + k) % (resolveDelay + 1)]);
+  }
+}
+
+bool LoadState(StateReader& in) {
+  bool ok = btable.load(in);
+  for (int s=0; s<NSTEP; s++) {
+    ok = ok && gtable[CFG::STEP[s]].load(in, 1 << logg(CFG::STEP[s]));
+  }
+  for (int t=0; t<2; t++) {
+    for (int i=0; i<(1<<LOGC); i++) {
+      int8_t v;
+      ok = ok && in.Get(v);
+      if (ok) ctable[t][i].write(v);
+    }
+  }
+  ok = ok && ghist.load(in) && lhist.load(in) && in.Get(phist);
+  ok = ok && UC.load(in) && UT.load(in) && TICK.load(in);
+  for (int i=0; i<NSTEP+1; i++) {
+    for (int j=0; j<NSTEP+1; j++) {
+      ok = ok && UA[i][j].load(in);
+    }
+  }
+  int n = 0;
+  ok = ok && in.Get(n) && n >= 0 && n <= resolveDelay;
+  for (int k=0; ok && k<n; k++) {
+    ok = loadInFlight(in, inflight[k]);
+  }
+  oldest = 0;
+  numInFlight = ok ? n : 0;
+  hashHistories();
+  return ok;
 }
 
 
@@ -444,28 +1113,39 @@ int F (int A, int size, int bank, int width) {
   return (A);
 }
 
+// Recomputes the history-only hash terms of every bank in one pass.
+// Called whenever ghist or phist change.
+void hashHistories() {
+  #pragma GCC unroll 32
+  for (int i=0; i<NHIST; i++) {
+    HIDX[i] = ghist.gidx(i) ^ FP[i][phist];
+    HTAG[i] = ghist.gtag(i);
+  }
+  for (int i=0; i<NSTAT; i++) {
+    HCI[i] = ghist.cgidx(i) ^ FC[i][phist];
+  }
+}
+
 // gindex computes a full hash of pc, ghist and phist
-uint32_t gindex(uint32_t pc, int bank, int hist) {
+uint32_t gindex(uint32_t pc, int bank, uint32_t lh) {
   // we combine local branch history for the TAGE index computation
   uint32_t index =
-    lhist.read(pc, l[bank], logg[bank]) ^
-    ghist.gidx(bank, m[bank], logg[bank]) ^
-    F(hist, p[bank], bank, logg[bank]) ^
-    (pc >> (abs (logg[bank] - bank) + 1)) ^ pc ;
-  return index & ((1 << logg[bank]) - 1);
+    LocalHistory::fold(lh, CFG::l[bank], logg(bank)) ^
+    HIDX[bank] ^
+    (pc >> GSHIFT[bank]) ^ pc ;
+  return index & ((1 << logg(bank)) - 1);
 }
 
 //  tag computation for TAGE predictor
 uint32_t gtag(uint32_t pc, int bank) {
-  uint32_t tag = ghist.gtag(bank, m[bank], TB[bank]) ^ pc ;
-  return (tag & ((1 << TB[bank]) - 1));
+  uint32_t tag = HTAG[bank] ^ pc ;
+  return (tag & ((1 << tb(bank)) - 1));
 }
 
 // index computation for statistical corrector predictor
-uint32_t cgindex (uint32_t pc, int bank, int hist, int size) {
+uint32_t cgindex (uint32_t pc, int bank, int size) {
   uint32_t index =
-    ghist.cgidx(bank, cg[bank], size) ^
-    F(hist, cp[bank], bank, size) ^
+    HCI[bank] ^
     (pc >> (abs (size - (bank+1)) + 1)) ^ pc ;
   return index & ((1 << size) - 1);
 }
@@ -480,37 +1160,56 @@ uint32_t clindex (uint32_t pc, int bank, int size) {
 
 int uaindex(int bank) {
   for(int i=0; i<NSTEP; i++) {
-    if(bank < STEP[i]) return i;
+    if(bank < CFG::STEP[i]) return i;
   }
   return NSTEP;
 }
   
+// Update the index values for interleaving
+void shareIndices(uint32_t *gi) {
+  for (int s=0; s<NSTEP; s++) {
+    for (int i=CFG::STEP[s]+1; i<CFG::STEP[s+1]; i++) {
+      gi[i]=((gi[CFG::STEP[s]]&7)^(i-CFG::STEP[s]))+(gi[i]<<3);
+      gi[i]&=(1<<logg(CFG::STEP[s]))-1; // offsets above 7 would run off the shared table
+    }
+  }
+}
+
 bool predict(uint32_t pc) {
-  bool pred_taken = true;
-  
     // Compute index values
+    uint32_t lh = lhist.get(pc);
+    #pragma GCC unroll 32
     for (int i = 0; i < NHIST; i++) {
-      GI[i] = gindex(pc, i, phist);
+      GI[i] = gindex(pc, i, lh);
       GTAG[i] = gtag(pc, i);
     }
-    
-    // Update the index values for interleaving
-    for (int s=0; s<NSTEP; s++) {
-      for (int i=STEP[s]+1; i<STEP[s+1]; i++) {
-        GI[i]=((GI[STEP[s]]&7)^(i-STEP[s]))+(GI[i]<<3);
-      }
-    }
-    
+    shareIndices(GI);
+    return lookup(pc);
+}
+
+// Reads the tables at GI/GTAG and combines the components
+bool lookup(uint32_t pc) {
+  bool pred_taken = true;
+  
     // Compute the prediction result of TAGE predictor
+    // The longest hitting bank provides HitPred and the next longest
+    // AltPred; either falls back to the bimodal table.
+    #pragma GCC unroll 32
+    for (int i=0; i<NHIST; i++) {
+      PTAG[i] = gtable[i].tag[GI[i]];
+      WTAG[i] = GTAG[i];
+    }
+    uint32_t hits = TagMatch(PTAG, WTAG) & (uint32_t)((1ULL << NHIST) - 1);
     HitBank = AltBank = -1;
     HitPred = AltPred = btable.predict(pc);
-    for (int i=0; i<NHIST; i++) {
-      if (gtable[i][GI[i]].tag == GTAG[i]) {
-        AltBank = HitBank;
-        HitBank = i;
-        AltPred = HitPred;
-        HitPred = gtable[i][GI[i]].c.pred();
-      }        
+    if (hits) {
+      HitBank = 31 - __builtin_clz(hits);
+      HitPred = gtable[HitBank].pred(GI[HitBank]);
+      hits &= ~(1u << HitBank);
+      if (hits) {
+        AltBank = 31 - __builtin_clz(hits);
+        AltPred = gtable[AltBank].pred(GI[AltBank]);
+      }
     }
     
     // Select the highest confident prediction result
@@ -518,17 +1217,19 @@ bool predict(uint32_t pc) {
     TagePred = HitPred;
     if (HitBank >= 0) {
       int u = UA[uaindex(HitBank)][uaindex(AltBank)].read();
-      if((u>=0)&&gtable[HitBank][GI[HitBank]].newalloc()) {
+      if((u>=0)&&gtable[HitBank].newalloc(GI[HitBank])) {
         TagePred = AltPred;
         TageBank = AltBank;
       }
     }
     pred_taken = TagePred;
+    if (TageBank < 0) Provider = PROVIDER_BIMODAL;
+    else Provider = (TageBank == HitBank) ? PROVIDER_HITBANK : PROVIDER_ALTBANK;
     
     // Compute the index values of the static corrector predictor
     CI[0] = pc & ((1<<LOGC)-1);
     for (int i=0; i<NSTAT; i++) {
-      CI[i+1] = cgindex(pc, i, phist, LOGC-CBANK);
+      CI[i+1] = cgindex(pc, i, LOGC-CBANK);
     }
     for (int i=0; i<MSTAT; i++) {
       CI[i+NSTAT+1] = clindex(pc, i, LOGC-CBANK);
@@ -543,19 +1244,98 @@ bool predict(uint32_t pc) {
     // Overwrite TAGE prediction result if the confidence of
     // the static corrector predictor is higher than the threshold.
     if (HitBank >= 0) {
-      SCSum = 6 * (2 * gtable[HitBank][GI[HitBank]].c.read() + 1);
+      SCSum = 6 * (2 * gtable[HitBank].c[GI[HitBank]] + 1);
       for (int i=0; i < TSTAT; i++) {
         SCSum += (2 * ctable[TagePred][CI[i]].read()) + 1;
       }
       SCPred = (SCSum >= 0);
       if (abs (SCSum) >= UC.read(5)) {
         pred_taken = SCPred;
+        if (SCPred != TagePred) Provider = PROVIDER_SC;
       }
     }
   return pred_taken;
 }
 
 void update(uint32_t pc, bool taken, uint32_t target) {
+  train(pc, taken);
+  pushHistory(pc, taken);
+}
+
+//////////////////////////////////////////////////
+// Speculative history management
+//////////////////////////////////////////////////
+void saveResults(InFlight &e) const {
+  memcpy(e.GI, GI, sizeof(GI));
+  memcpy(e.GTAG, GTAG, sizeof(GTAG));
+  memcpy(e.CI, CI, sizeof(CI));
+  e.HitPred = HitPred; e.AltPred = AltPred; e.TagePred = TagePred; e.SCPred = SCPred;
+  e.HitBank = HitBank; e.AltBank = AltBank; e.TageBank = TageBank; e.SCSum = SCSum;
+}
+
+void loadResults(const InFlight &e) {
+  memcpy(GI, e.GI, sizeof(GI));
+  memcpy(GTAG, e.GTAG, sizeof(GTAG));
+  memcpy(CI, e.CI, sizeof(CI));
+  HitPred = e.HitPred; AltPred = e.AltPred; TagePred = e.TagePred; SCPred = e.SCPred;
+  HitBank = e.HitBank; AltBank = e.AltBank; TageBank = e.TageBank; SCSum = e.SCSum;
+}
+
+// Written field by field, so checkpoints carry no struct padding
+void saveInFlight(StateWriter& out, const InFlight &e) const {
+  bool flags[6] = {e.histDir, e.taken, e.HitPred, e.AltPred, e.TagePred, e.SCPred};
+  out.Put(e.pc);
+  out.PutBits(flags, 6);
+  out.PutArray(e.GI, NHIST);
+  out.PutArray(e.GTAG, NHIST);
+  out.PutArray(e.CI, TSTAT);
+  out.Put(e.HitBank); out.Put(e.AltBank); out.Put(e.TageBank); out.Put(e.SCSum);
+  ghist.saveCheckpoint(out, e.gcp);
+  out.Put(e.phist);
+  out.Put(e.lhist);
+}
+
+// Rejects banks and indices that would run off the tables
+bool loadInFlight(StateReader& in, InFlight &e) {
+  bool flags[6];
+  bool ok = in.Get(e.pc) && in.GetBits(flags, 6);
+  ok = ok && in.GetArray(e.GI, NHIST) && in.GetArray(e.GTAG, NHIST) && in.GetArray(e.CI, TSTAT);
+  ok = ok && in.Get(e.HitBank) && in.Get(e.AltBank) && in.Get(e.TageBank) && in.Get(e.SCSum);
+  ok = ok && ghist.loadCheckpoint(in, e.gcp) && in.Get(e.phist) && in.Get(e.lhist);
+  if (!ok) return false;
+  e.histDir = flags[0]; e.taken = flags[1];
+  e.HitPred = flags[2]; e.AltPred = flags[3]; e.TagePred = flags[4]; e.SCPred = flags[5];
+  for (int s=0; s<NSTEP; s++) {
+    for (int i=CFG::STEP[s]; i<CFG::STEP[s+1]; i++) {
+      if (e.GI[i] >= (1u << logg(CFG::STEP[s]))) return false;
+    }
+  }
+  for (int i=0; i<TSTAT; i++) {
+    if (e.CI[i] >= (1u << LOGC)) return false;
+  }
+  return e.HitBank >= -1 && e.HitBank < NHIST && e.AltBank >= -1 && e.AltBank < NHIST &&
+         e.TageBank >= -1 && e.TageBank < NHIST;
+}
+
+// Trains the tables with the oldest in-flight branch and repairs the
+// histories if it was mispredicted, in which case it is the youngest.
+void resolve() {
+  InFlight &e = inflight[oldest];
+  loadResults(e);
+  train(e.pc, e.taken);
+
+  if (e.histDir != e.taken) {
+    assert(numInFlight == 1);
+    ghist.restore(e.gcp);
+    phist = e.phist;
+    lhist.set(e.pc, e.lhist);
+    pushHistory(e.pc, e.taken);
+  }
+  oldest = (oldest + 1) % (resolveDelay + 1);
+  numInFlight--;
+}
+
+void train(uint32_t pc, bool taken) {
     if (HitBank >= 0) {
       // Updates the threshold of the static corrector predictor
       if (TagePred != SCPred) {
@@ -584,7 +1364,7 @@ void update(uint32_t pc, bool taken, uint32_t target) {
     // Determining the allocation of new entries
     bool ALLOC = (TagePred != taken) && (HitBank < (NHIST-1));
     if (HitBank >= 0) {
-      if (gtable[HitBank][GI[HitBank]].newalloc()) {
+      if (gtable[HitBank].newalloc(GI[HitBank])) {
         if (HitPred == taken) {
           ALLOC = false;
         }
@@ -598,8 +1378,8 @@ void update(uint32_t pc, bool taken, uint32_t target) {
       // Allocate new entries up to "NALLOC" entries are allocated
       int T = 0;
       for (int i=HitBank+1; i<NHIST; i+=1) {
-        if (gtable[i][GI[i]].u.read() == 0) {
-          gtable[i][GI[i]].init(GTAG[i], taken, 0);
+        if (gtable[i].uget(GI[i]) == 0) {
+          gtable[i].init(GI[i], GTAG[i], taken, 0);
           TICK.add(-1);
           if (T == NALLOC) break;
           T += 1;
@@ -609,24 +1389,25 @@ void update(uint32_t pc, bool taken, uint32_t target) {
         }
       }
       
-      // Reset useful bit to release OLD useful entries
+      // Reset useful bit to release OLD useful entries; the decrement
+      // of every entry is applied lazily through the aging epoch
       bool resetUbit = TICK.satmax();
       if (resetUbit) {
         TICK.write(0);
         for (int s=0; s<NSTEP; s++) {
-          for (int j=0; j<(1<<logg[STEP[s]]); j++)
-            gtable[STEP[s]][j].u.add(-1);
+          gtable[CFG::STEP[s]].age();
         }
+        uepoch++;
       }
     }
     
     // Update prediction tables
     // This part is same with ISL-TAGE branch predictor.
     if (HitBank >= 0) {
-      gtable[HitBank][GI[HitBank]].c.update(taken);
-      if ((gtable[HitBank][GI[HitBank]].u.read() == 0)) {
+      gtable[HitBank].cupdate(GI[HitBank], taken);
+      if ((gtable[HitBank].uget(GI[HitBank]) == 0)) {
         if (AltBank >= 0) {
-          gtable[AltBank][GI[AltBank]].c.update(taken);
+          gtable[AltBank].cupdate(GI[AltBank], taken);
         } else {
           btable.update(pc, taken);
         }
@@ -641,29 +1422,1331 @@ void update(uint32_t pc, bool taken, uint32_t target) {
     if (HitBank >= 0) {
       bool useful = (HitPred == taken) && (AltPred != taken) ;
       if(useful) {
-        gtable[HitBank][GI[HitBank]].u.setmax();
+        gtable[HitBank].usetmax(GI[HitBank]);
       }
     }
 
-  //////////////////////////////////////////////////
-  // Branch history management.
-  //////////////////////////////////////////////////
+}
+
+//////////////////////////////////////////////////
+// Branch history management.
+//////////////////////////////////////////////////
+// The target hash of the original update shifts out of the history bit,
+// so only the direction is needed and the push can happen at predict time.
+void pushHistory(uint32_t pc, bool taken) {
   // Update global history and path history
-  ghist.update((((target ^ (target >> 3) ^ pc) << 1) + taken) & 1);
+  ghist.update(taken);
   phist <<= 1;
   phist += pc & 1;
   phist &= (1 << PHISTWIDTH) - 1;
   lhist.update(pc, taken);
+  hashHistories();
+}
+};
+
+typedef tage_predictor<TageConfigDefault> my_predictor;
+
+// spec: tage8k, tage32k or tage64k (or a plain tage), optionally followed by
+// a resolve delay in branches, e.g. tage64k:32
+template <class CFG>
+static Predictor* Create_tage(const std::vector<UINT32>& args) {
+   if(args.size() > 1) return NULL;
+   UINT32 delay = args.empty() ? 0 : args[0];
+   if(delay > (UINT32)tage_predictor<CFG>::MAX_RESOLVE_DELAY) return NULL;
+   return new tage_predictor<CFG>(delay);
+}
+
+// spec: openend or tage[:delay[:logg_delta[:tb_delta[:hist_pct]]]]
+// The geometry fields are signed and resize the default configuration
+// for table-size sweeps, e.g. "tage:0:-1" halves every global table and
+// "tage:0:0:0:25..400" sweeps the history lengths. Specs with them build
+// a runtime-configured predictor, which is slower than the compiled ones.
+static Predictor* Create_tage_sized(const std::vector<UINT32>& args) {
+   if(args.size() <= 1) return Create_tage<TageConfigDefault>(args);
+   if(args.size() > 4) return NULL;
+   UINT32 delay = args[0];
+   int logg_delta = (int)args[1];
+   int tb_delta = args.size() > 2 ? (int)args[2] : 0;
+   int hist_pct = args.size() > 3 ? (int)args[3] : 100;
+   if(delay > (UINT32)tage_predictor<TageConfigRuntime>::MAX_RESOLVE_DELAY) return NULL;
+   if(logg_delta < -4 || logg_delta > 8) return NULL;
+   if(tb_delta < -4 || tb_delta > 6) return NULL;
+   if(hist_pct < 1 || hist_pct > 1000) return NULL;
+   return new tage_predictor<TageConfigRuntime>(delay, logg_delta, tb_delta, hist_pct);
+}
+
+/////////////////////////////////////////////////////////////
+// perceptron
+/////////////////////////////////////////////////////////////
+// Hashed perceptron over global and local history. A row of PWIDTH int8
+// weights, picked by the PC, is dotted with a bias input and the newest
+// global and local history bits as +1/-1 inputs. On top of that, tables
+// of single weights indexed by the PC hashed with longer folded global
+// histories (from the same GlobalHistory as TAGE) and with the local
+// history (from its LocalHistory) add one weight each. The sign of the
+// sum is the prediction, and every selected weight trains when the
+// prediction was wrong or the sum was within an adaptive threshold.
+#define PWIDTH 32   // weights per row
+#define PGHIST 23   // global history inputs, after the bias
+#define PLHIST 8    // local history inputs, after the global ones
+#define PNTAB 8     // hashed global history tables
+#define PNLOC 2     // hashed local history tables
+#define PMAXHIST 220
+#define LOG_PROWS 8
+#define LOG_PTAB 10
+#define PTC_MAX 63  // threshold training counter range
+static const int PHIST[PNTAB] = {24, 32, 44, 60, 84, 116, 160, 220};
+static const int PLOCAL[PNLOC] = {PLHIST, LHISTWIDTH};
+
+// Dot product of a weight row with the +1/-1 inputs, and the matching
+// training step (add or subtract the inputs, saturating at +-127). Like
+// the tag match the AVX2 versions are picked from the CPU features (or
+// PERCEPTRON_SIMD=scalar|avx2) and give the same results.
+typedef int32_t (*PerceptronDotFn)(const int8_t *w, const int8_t *x);
+typedef void (*PerceptronTrainFn)(int8_t *w, const int8_t *x, bool taken);
+
+static int32_t PerceptronDotScalar(const int8_t *w, const int8_t *x) {
+   int32_t sum = 0;
+   for(int i = 0; i < PWIDTH; i++){
+      sum += w[i] * x[i];
+   }
+   return sum;
+}
+
+static void PerceptronTrainScalar(int8_t *w, const int8_t *x, bool taken) {
+   for(int i = 0; i < PWIDTH; i++){
+      int v = w[i] + (taken ? x[i] : -x[i]);
+      w[i] = (int8_t)(v > 127 ? 127 : (v < -127 ? -127 : v));
+   }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int32_t PerceptronDotAVX2(const int8_t *w, const int8_t *x) {
+   // negate the weights of -1 inputs, then add neighbours with
+   // saturation up to 16 and 32 bits
+   __m256i p = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)w),
+                                _mm256_loadu_si256((const __m256i *)x));
+   __m256i s16 = _mm256_maddubs_epi16(_mm256_set1_epi8(1), p);
+   __m256i s32 = _mm256_madd_epi16(s16, _mm256_set1_epi16(1));
+   __m128i s = _mm_add_epi32(_mm256_castsi256_si128(s32), _mm256_extracti128_si256(s32, 1));
+   s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+   s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+   return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void PerceptronTrainAVX2(int8_t *w, const int8_t *x, bool taken) {
+   __m256i v = _mm256_loadu_si256((const __m256i *)w);
+   __m256i in = _mm256_loadu_si256((const __m256i *)x);
+   v = taken ? _mm256_adds_epi8(v, in) : _mm256_subs_epi8(v, in);
+   // keep -128 out so negating a weight cannot overflow
+   v = _mm256_max_epi8(v, _mm256_set1_epi8(-127));
+   _mm256_storeu_si256((__m256i *)w, v);
+}
+#endif
+
+static bool PerceptronUseAVX2() {
+   const char *force = getenv("PERCEPTRON_SIMD");
+   if(force && strcmp(force, "scalar") == 0) return false;
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx2");
+#else
+   return false;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static const bool PerceptronAVX2 = PerceptronUseAVX2();
+static const PerceptronDotFn PerceptronDot = PerceptronAVX2 ? PerceptronDotAVX2 : PerceptronDotScalar;
+static const PerceptronTrainFn PerceptronTrain = PerceptronAVX2 ? PerceptronTrainAVX2 : PerceptronTrainScalar;
+#else
+static const PerceptronDotFn PerceptronDot = PerceptronDotScalar;
+static const PerceptronTrainFn PerceptronTrain = PerceptronTrainScalar;
+#endif
+
+class Predictor_perceptron : public Predictor {
+   UINT32 logRows;
+   UINT32 logTable;
+   std::vector<int8_t> rows; // PWIDTH weights per row
+   std::vector<int8_t> gtab[PNTAB];
+   std::vector<int8_t> ltab[PNLOC];
+   GlobalHistory<PNTAB, PMAXHIST> ghist;
+   LocalHistory lhist;
+   int8_t inputs[PWIDTH]; // bias, PGHIST global and PLHIST local inputs
+   int32_t theta;
+   int32_t tc;
+
+   // from the last GetPrediction
+   UINT32 row;
+   UINT32 gi[PNTAB];
+   UINT32 li[PNLOC];
+   int32_t sum;
+
+   static void Train(int8_t& w, bool taken) {
+      if(taken && w < 127) w++;
+      else if(!taken && w > -127) w--;
+   }
+
+public:
+   Predictor_perceptron(UINT32 log_rows = LOG_PROWS, UINT32 log_table = LOG_PTAB)
+      : logRows(log_rows), logTable(log_table), rows((size_t)PWIDTH << log_rows, 0),
+        theta((int32_t)(1.93 * (PWIDTH + PNTAB + PNLOC) + 14)), tc(0), row(0), sum(0) {
+      for(int i = 0; i < PNTAB; i++) gtab[i].assign((size_t)1 << logTable, 0);
+      for(int i = 0; i < PNLOC; i++) ltab[i].assign((size_t)1 << logTable, 0);
+      // only the index folds are used; the tag and corrector lanes get the
+      // same widths
+      int width[PNTAB];
+      for(int i = 0; i < PNTAB; i++) width[i] = logTable;
+      ghist.init();
+      ghist.setup(PHIST, width, width, PHIST, logTable);
+      lhist.init();
+      inputs[0] = 1;
+      for(int i = 1; i < PWIDTH; i++) inputs[i] = -1;
+      for(int i = 0; i < PNTAB; i++) gi[i] = 0;
+      for(int i = 0; i < PNLOC; i++) li[i] = 0;
+   }
+
+   bool GetPrediction(UINT32 PC) {
+      UINT32 mask = (1 << logTable) - 1;
+      UINT32 h = PC ^ (PC >> logTable);
+      UINT32 lh = lhist.get(PC);
+      for(int i = 0; i < PLHIST; i++){
+         inputs[1 + PGHIST + i] = ((lh >> i) & 1) ? 1 : -1;
+      }
+      row = (PC ^ (PC >> logRows)) & ((1 << logRows) - 1);
+      sum = PerceptronDot(&rows[(size_t)row * PWIDTH], inputs);
+      for(int i = 0; i < PNTAB; i++){
+         gi[i] = (h ^ ghist.gidx(i)) & mask;
+         sum += gtab[i][gi[i]];
+      }
+      for(int i = 0; i < PNLOC; i++){
+         li[i] = (h ^ (LocalHistory::fold(lh, PLOCAL[i], logTable) << i)) & mask;
+         sum += ltab[i][li[i]];
+      }
+      return sum >= 0 ? TAKEN : NOT_TAKEN;
+   }
+
+   void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+      bool wrong = (sum >= 0) != resolveDir;
+      if(wrong || abs(sum) <= theta){
+         PerceptronTrain(&rows[(size_t)row * PWIDTH], inputs, resolveDir);
+         for(int i = 0; i < PNTAB; i++) Train(gtab[i][gi[i]], resolveDir);
+         for(int i = 0; i < PNLOC; i++) Train(ltab[i][li[i]], resolveDir);
+
+         // adaptive threshold: mispredictions raise it, low-confidence
+         // correct predictions lower it
+         if(wrong){
+            if(++tc > PTC_MAX){
+               theta++;
+               tc = 0;
+            }
+         }else if(--tc < -PTC_MAX - 1){
+            theta--;
+            tc = 0;
+         }
+      }
+
+      // shift the new outcome into the global inputs
+      memmove(&inputs[2], &inputs[1], PGHIST - 1);
+      inputs[1] = resolveDir ? 1 : -1;
+      ghist.update(resolveDir);
+      lhist.update(PC, resolveDir);
+   }
+
+   void GetStorage(std::vector<StorageComponent>& parts) const {
+      AddStorage(parts, "rows", (UINT64)rows.size() * 8);
+      AddStorage(parts, "gtables", (UINT64)PNTAB * 8 << logTable);
+      AddStorage(parts, "ltables", (UINT64)PNLOC * 8 << logTable);
+      AddStorage(parts, "lhist", LHTSIZE * LHISTWIDTH);
+      // the oldest bit PMAXHIST is still needed to retire it from the folds
+      AddStorage(parts, "ghist", PMAXHIST + 1);
+      AddStorage(parts, "folded", (UINT64)PNTAB * logTable); // index folds only
+      AddStorage(parts, "theta", 16 + 7);
+   }
+
+   void SaveState(StateWriter& out) const {
+      out.PutArray(rows.data(), rows.size());
+      for(int i = 0; i < PNTAB; i++) out.PutArray(gtab[i].data(), gtab[i].size());
+      for(int i = 0; i < PNLOC; i++) out.PutArray(ltab[i].data(), ltab[i].size());
+      ghist.save(out);
+      lhist.save(out);
+      out.PutArray(inputs, PWIDTH);
+      out.Put(theta);
+      out.Put(tc);
+   }
+
+   bool LoadState(StateReader& in) {
+      bool ok = in.GetArray(rows.data(), rows.size());
+      for(int i = 0; i < PNTAB; i++) ok = ok && in.GetArray(gtab[i].data(), gtab[i].size());
+      for(int i = 0; i < PNLOC; i++) ok = ok && in.GetArray(ltab[i].data(), ltab[i].size());
+      return ok && ghist.load(in) && lhist.load(in) && in.GetArray(inputs, PWIDTH) &&
+             in.Get(theta) && in.Get(tc);
+   }
+};
+
+// spec: perceptron[:log_rows[:log_table]]
+static Predictor* Create_perceptron(const std::vector<UINT32>& args) {
+   if(args.size() > 2) return NULL;
+   UINT32 logRows = args.size() > 0 ? args[0] : LOG_PROWS;
+   UINT32 logTable = args.size() > 1 ? args[1] : LOG_PTAB;
+   if(logRows > 24 || logTable < 3 || logTable > 24) return NULL;
+   return new Predictor_perceptron(logRows, logTable);
+}
+
+/////////////////////////////////////////////////////////////
+// Predictor registry
+/////////////////////////////////////////////////////////////
+struct PredictorEntry {
+   std::string name;
+   PredictorFactory factory;
+};
+
+static std::vector<PredictorEntry>& GetRegistry() {
+   static std::vector<PredictorEntry> registry;
+   if(registry.empty()){
+      PredictorEntry builtin[] = {
+         {"2bitsat", Create_2bitsat},
+         {"bimodal", Create_2bitsat},
+         {"2level", Create_2level},
+         {"openend", Create_tage_sized},
+         {"tage", Create_tage_sized},
+         {"tage8k", Create_tage<TageConfig8KB>},
+         {"tage32k", Create_tage<TageConfig32KB>},
+         {"tage64k", Create_tage<TageConfig64KB>},
+         {"perceptron", Create_perceptron},
+      };
+      registry.assign(builtin, builtin + sizeof(builtin) / sizeof(builtin[0]));
+   }
+   return registry;
+}
+
+bool RegisterPredictor(const char* name, PredictorFactory factory) {
+   std::vector<PredictorEntry>& registry = GetRegistry();
+   for(size_t i = 0; i < registry.size(); i++){
+      if(registry[i].name == name) return false;
+   }
+   PredictorEntry entry = {name, factory};
+   registry.push_back(entry);
+   return true;
+}
+
+Predictor* CreatePredictor(const char* spec) {
+   // split "name:arg:arg..." into the family name and numeric fields
+   const char* colon = strchr(spec, ':');
+   std::string name = colon ? std::string(spec, colon - spec) : std::string(spec);
+   std::vector<UINT32> args;
+   while(colon != NULL){
+      const char* field = colon + 1;
+      char* end;
+      // negative fields wrap, factories taking signed fields cast back
+      long long v = strtoll(field, &end, 0);
+      if(end == field || (*end != ':' && *end != '\0')) return NULL;
+      if(v < INT32_MIN || v > (long long)UINT32_MAX) return NULL;
+      args.push_back((UINT32)v);
+      colon = (*end == ':') ? end : NULL;
+   }
+
+   std::vector<PredictorEntry>& registry = GetRegistry();
+   for(size_t i = 0; i < registry.size(); i++){
+      if(registry[i].name == name){
+         Predictor* pred = registry[i].factory(args);
+         if(pred != NULL) pred->SetName(spec);
+         return pred;
+      }
+   }
+   return NULL;
+}
+
+void ListPredictors(FILE* out) {
+   std::vector<PredictorEntry>& registry = GetRegistry();
+   for(size_t i = 0; i < registry.size(); i++){
+      fprintf(out, "%s\n", registry[i].name.c_str());
+   }
+}
+
+/////////////////////////////////////////////////////////////
+// Single-pass evaluation of a batch of predictors
+/////////////////////////////////////////////////////////////
+PredictorBatch::~PredictorBatch() {
+   Flush();
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+   }
+   workReady.notify_all();
+   for(size_t i = 0; i < workers.size(); i++){
+      workers[i].join();
+   }
+   for(size_t i = 0; i < preds.size(); i++){
+      delete preds[i];
+   }
+}
+
+bool PredictorBatch::Add(const char* spec) {
+   assert(workers.empty());
+   Predictor* pred = (spec[0] == '@') ? LoadCheckpoint(spec + 1) : CreatePredictor(spec);
+   if(pred == NULL) return false;
+   preds.push_back(pred);
+   mispreds.push_back(0);
+   redirects.push_back(0);
+   return true;
+}
+
+// expands the first "lo..hi" field of spec and recurses on the rest
+static bool ExpandSweep(const std::string& spec, std::vector<std::string>& out) {
+   size_t dots = spec.find("..");
+   if(dots == std::string::npos){
+      out.push_back(spec);
+      return true;
+   }
+   size_t begin = spec.rfind(':', dots);
+   size_t end = spec.find(':', dots);
+   if(begin == std::string::npos) return false;
+   if(end == std::string::npos) end = spec.size();
+
+   char* stop;
+   std::string lo_str = spec.substr(begin + 1, dots - begin - 1);
+   std::string hi_str = spec.substr(dots + 2, end - dots - 2);
+   unsigned long lo = strtoul(lo_str.c_str(), &stop, 0);
+   if(lo_str.empty() || *stop != '\0' || lo == 0) return false;
+   unsigned long hi = strtoul(hi_str.c_str(), &stop, 0);
+   if(hi_str.empty() || *stop != '\0' || hi < lo) return false;
+
+   for(unsigned long v = lo; v <= hi; v *= 2){
+      char field[32];
+      snprintf(field, sizeof(field), "%lu", v);
+      if(!ExpandSweep(spec.substr(0, begin + 1) + field + spec.substr(end), out)) return false;
+   }
+   return true;
+}
+
+int PredictorBatch::AddSweep(const char* spec) {
+   assert(workers.empty());
+   if(spec[0] == '@') return Add(spec) ? 1 : 0;
+   std::vector<std::string> points;
+   if(!ExpandSweep(spec, points)) return 0;
+
+   std::vector<Predictor*> built;
+   for(size_t i = 0; i < points.size(); i++){
+      Predictor* pred = CreatePredictor(points[i].c_str());
+      if(pred == NULL){
+         for(size_t j = 0; j < built.size(); j++) delete built[j];
+         return 0;
+      }
+      built.push_back(pred);
+   }
+   preds.insert(preds.end(), built.begin(), built.end());
+   mispreds.resize(preds.size(), 0);
+   redirects.resize(preds.size(), 0);
+   return (int)built.size();
+}
+
+void PredictorBatch::EnableProfiles() {
+   assert(workers.empty() && profiles.empty());
+   for(size_t i = 0; i < preds.size(); i++){
+      ProfiledPredictor* prof = new ProfiledPredictor(preds[i]);
+      profiles.push_back(prof);
+      preds[i] = prof;
+   }
+}
+
+void PredictorBatch::ReportProfiles(FILE* out, UINT64 numInsts, size_t topN) {
+   Flush();
+   for(size_t i = 0; i < profiles.size(); i++){
+      profiles[i]->Report(out, numInsts, topN);
+   }
+}
+
+#ifdef PREDICTOR_LATENCY
+void PredictorBatch::EnableLatency() {
+   assert(workers.empty() && latency.empty());
+   for(size_t i = 0; i < preds.size(); i++){
+      LatencyPredictor* timed = new LatencyPredictor(preds[i]);
+      latency.push_back(timed);
+      preds[i] = timed;
+   }
+}
+
+void PredictorBatch::ReportLatency(FILE* out) {
+   Flush();
+   LatencyHistogram::PrintHeader(out);
+   for(size_t i = 0; i < latency.size(); i++){
+      latency[i]->Report(out);
+   }
+}
+#endif
+
+void PredictorBatch::Process(UINT32 PC, bool resolveDir, UINT32 branchTarget, bool targetReady) {
+   numBranches++;
+   BranchRecord rec = {PC, branchTarget, resolveDir, true, targetReady};
+   Enqueue(rec);
+}
+
+void PredictorBatch::Warm(UINT32 PC, bool resolveDir, UINT32 branchTarget) {
+   BranchRecord rec = {PC, branchTarget, resolveDir, false, true};
+   Enqueue(rec);
+}
+
+void PredictorBatch::Enqueue(const BranchRecord& rec) {
+   if(numThreads == 1){
+      chunk[0].push_back(rec);
+      if(chunk[0].size() == CHUNK_RECORDS){
+         Evaluate(0, chunk[0]);
+         chunk[0].clear();
+      }
+      return;
+   }
+
+   if(workers.empty()) StartWorkers();
+   chunk[fill].push_back(rec);
+   if(chunk[fill].size() == CHUNK_RECORDS){
+      Publish();
+   }
+}
+
+void PredictorBatch::EndWindow(UINT64 numInsts) {
+   Flush();
+   windowStart.resize(preds.size(), 0);
+   sampleSum.resize(preds.size(), 0.0);
+   sampleSq.resize(preds.size(), 0.0);
+   for(size_t i = 0; i < preds.size(); i++){
+      double mpki = numInsts ? 1000.0 * (double)(mispreds[i] - windowStart[i]) / (double)numInsts : 0.0;
+      sampleSum[i] += mpki;
+      sampleSq[i] += mpki * mpki;
+      windowStart[i] = mispreds[i];
+   }
+   numWindows++;
+}
+
+// runs one chunk through the predictors owned by shard
+void PredictorBatch::Evaluate(int shard, const std::vector<BranchRecord>& records) {
+   for(size_t i = shard; i < preds.size(); i += numThreads){
+      Predictor* pred = preds[i];
+      ProfiledPredictor* prof = profiles.empty() ? NULL : profiles[i];
+      UINT64 miss = 0, redirect = 0;
+      for(size_t r = 0; r < records.size(); r++){
+         const BranchRecord& rec = records[r];
+         if(prof) prof->SetMeasure(rec.measure);
+         bool predDir = pred->GetPrediction(rec.PC);
+         pred->UpdatePredictor(rec.PC, rec.resolveDir, predDir, rec.branchTarget);
+         bool wrongDir = (predDir != rec.resolveDir);
+         miss += rec.measure && wrongDir;
+         // a correctly predicted taken branch still redirects without a target
+         redirect += rec.measure && (wrongDir || (rec.resolveDir && !rec.targetReady));
+      }
+      mispreds[i] += miss;
+      redirects[i] += redirect;
+   }
+}
+
+void PredictorBatch::StartWorkers() {
+   chunk[0].reserve(CHUNK_RECORDS);
+   chunk[1].reserve(CHUNK_RECORDS);
+   for(int t = 0; t < numThreads; t++){
+      workers.push_back(std::thread(&PredictorBatch::WorkerLoop, this, t));
+   }
+}
+
+void PredictorBatch::WorkerLoop(int shard) {
+   UINT64 seen = 0;
+   while(true){
+      const std::vector<BranchRecord>* records;
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         workReady.wait(guard, [&]{ return stopping || generation != seen; });
+         if(generation == seen) return; // stopping with no work left
+         seen = generation;
+         records = current;
+      }
+      Evaluate(shard, *records);
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         if(--pending == 0) workDone.notify_all();
+      }
+   }
+}
+
+// hands the chunk being filled to the workers and switches to the other
+// one, which is free once the previous chunk has been evaluated
+void PredictorBatch::Publish() {
+   {
+      std::unique_lock<std::mutex> guard(lock);
+      workDone.wait(guard, [&]{ return pending == 0; });
+      current = &chunk[fill];
+      pending = numThreads;
+      generation++;
+   }
+   workReady.notify_all();
+   fill ^= 1;
+   chunk[fill].clear();
+}
+
+void PredictorBatch::Flush() {
+   if(numThreads == 1){
+      if(!chunk[0].empty()){
+         Evaluate(0, chunk[0]);
+         chunk[0].clear();
+      }
+      return;
+   }
+   if(workers.empty()) return;
+   if(!chunk[fill].empty()){
+      Publish();
+   }
+   std::unique_lock<std::mutex> guard(lock);
+   workDone.wait(guard, [&]{ return pending == 0; });
+}
+
+void PredictorBatch::Report(FILE* out, UINT64 numInsts) {
+   Flush();
+   fprintf(out, "  NUM_INSTRUCTIONS     : %10llu\n", (unsigned long long)numInsts);
+   fprintf(out, "  NUM_CONDITIONAL_BR   : %10llu\n", (unsigned long long)numBranches);
+   fprintf(out, "  %-24s %14s %18s %20s\n", "PREDICTOR", "STORAGE_BITS",
+           "NUM_MISPREDICTIONS", "MISPRED_PER_1K_INST");
+   for(size_t i = 0; i < preds.size(); i++){
+      double mpki = numInsts ? 1000.0 * (double)mispreds[i] / (double)numInsts : 0.0;
+      fprintf(out, "  %-24s %14llu %18llu %20.4f\n", preds[i]->GetName().c_str(),
+              (unsigned long long)preds[i]->GetStorageBits(),
+              (unsigned long long)mispreds[i], mpki);
+   }
+}
+
+void PredictorBatch::ReportRedirects(FILE* out, UINT64 numInsts, UINT64 otherMisses) {
+   Flush();
+   fprintf(out, "  %-24s %18s %18s %20s\n", "PREDICTOR", "NUM_MISPREDICTIONS",
+           "NUM_REDIRECTS", "REDIRECTS_PER_1K_INST");
+   for(size_t i = 0; i < preds.size(); i++){
+      UINT64 total = redirects[i] + otherMisses;
+      double rpki = numInsts ? 1000.0 * (double)total / (double)numInsts : 0.0;
+      fprintf(out, "  %-24s %18llu %18llu %20.4f\n", preds[i]->GetName().c_str(),
+              (unsigned long long)mispreds[i], (unsigned long long)total, rpki);
+   }
+}
+
+bool PredictorBatch::SaveCheckpoints(const char* prefix) {
+   Flush();
+   bool ok = true;
+   for(size_t i = 0; i < preds.size(); i++){
+      char path[4096];
+      snprintf(path, sizeof(path), "%s%zu.ckpt", prefix, i);
+      ok = SaveCheckpoint(preds[i], path) && ok;
+   }
+   return ok;
+}
+
+// The windows are treated as independent samples of equal length, so the
+// interval is the normal approximation mean +- 1.96 s / sqrt(n). It is
+// only meaningful with a few dozen windows or more.
+void PredictorBatch::ReportSamples(FILE* out) {
+   Flush();
+   fprintf(out, "  NUM_WINDOWS          : %10llu\n", (unsigned long long)numWindows);
+   if(numWindows == 0) return;
+   fprintf(out, "  %-24s %14s %14s %12s\n", "PREDICTOR", "MPKI_MEAN", "MPKI_95CI", "REL_ERROR");
+   for(size_t i = 0; i < preds.size(); i++){
+      double n = (double)numWindows;
+      double mean = sampleSum[i] / n;
+      double var = (numWindows > 1) ? (sampleSq[i] - n * mean * mean) / (n - 1) : 0.0;
+      double half = 1.96 * sqrt(var > 0 ? var : 0) / sqrt(n);
+      fprintf(out, "  %-24s %14.4f %14.4f %11.2f%%\n", preds[i]->GetName().c_str(),
+              mean, half, mean > 0 ? 100.0 * half / mean : 0.0);
+   }
+}
+
+int PredictorBatch::Best(UINT64 budgetBits) {
+   Flush();
+   int best = -1;
+   UINT64 bestBits = 0;
+   for(size_t i = 0; i < preds.size(); i++){
+      UINT64 bits = preds[i]->GetStorageBits();
+      if(bits > budgetBits) continue;
+      if(best < 0 || mispreds[i] < mispreds[best] ||
+         (mispreds[i] == mispreds[best] && bits < bestBits)){
+         best = (int)i;
+         bestBits = bits;
+      }
+   }
+   return best;
 }
+
+void PrintStorage(FILE* out, const Predictor* pred) {
+   std::vector<StorageComponent> parts;
+   pred->GetStorage(parts);
+   UINT64 total = 0;
+   fprintf(out, "  %s\n", pred->GetName().c_str());
+   for(size_t i = 0; i < parts.size(); i++){
+      fprintf(out, "    %-12s %12llu bits\n", parts[i].name.c_str(), (unsigned long long)parts[i].bits);
+      total += parts[i].bits;
+   }
+   fprintf(out, "    %-12s %12llu bits (%.2f KB)\n", "total", (unsigned long long)total, total / 8192.0);
+}
+
+/////////////////////////////////////////////////////////////
+// Per-branch misprediction profile
+/////////////////////////////////////////////////////////////
+static const char* const PROVIDER_NAMES[NUM_PROVIDERS] = {
+   "other", "bimodal", "hitbank", "altbank", "sc"
 };
 
-my_predictor* tage;
+ProfiledPredictor::ProfiledPredictor(Predictor* inner)
+   : pred(inner), provider(PROVIDER_OTHER), measure(true), table(1024), used(0) {
+   SetName(inner->GetName());
+}
+
+ProfiledPredictor::~ProfiledPredictor() {
+   delete pred;
+}
+
+bool ProfiledPredictor::GetPrediction(UINT32 PC) {
+   bool predDir = pred->GetPrediction(PC);
+   provider = pred->GetProvider();
+   return predDir;
+}
+
+void ProfiledPredictor::UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+   pred->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
+   if(!measure) return;
+   Entry& e = Find(PC);
+   bool miss = (predDir != resolveDir);
+   e.executed++;
+   e.mispredicted += miss;
+   e.provided[provider]++;
+   e.missed[provider] += miss;
+}
+
+// returns the slot holding PC, claiming a free one on first sight
+ProfiledPredictor::Entry& ProfiledPredictor::Find(UINT32 PC) {
+   size_t mask = table.size() - 1;
+   size_t slot = (PC * 0x9E3779B1u) & mask;
+   while(table[slot].executed != 0 && table[slot].PC != PC){
+      slot = (slot + 1) & mask;
+   }
+   if(table[slot].executed == 0){
+      if(2 * (used + 1) > table.size()){
+         Grow();
+         return Find(PC);
+      }
+      table[slot].PC = PC;
+      used++;
+   }
+   return table[slot];
+}
+
+void ProfiledPredictor::Grow() {
+   std::vector<Entry> old(table.size() * 2);
+   old.swap(table);
+   size_t mask = table.size() - 1;
+   for(size_t i = 0; i < old.size(); i++){
+      if(old[i].executed == 0) continue;
+      size_t slot = (old[i].PC * 0x9E3779B1u) & mask;
+      while(table[slot].executed != 0){
+         slot = (slot + 1) & mask;
+      }
+      table[slot] = old[i];
+   }
+}
+
+void ProfiledPredictor::Report(FILE* out, UINT64 numInsts, size_t topN) const {
+   std::vector<const Entry*> order;
+   UINT64 total[NUM_PROVIDERS] = {0};
+   UINT64 totalMissed[NUM_PROVIDERS] = {0};
+   for(size_t i = 0; i < table.size(); i++){
+      if(table[i].executed == 0) continue;
+      order.push_back(&table[i]);
+      for(int p = 0; p < NUM_PROVIDERS; p++){
+         total[p] += table[i].provided[p];
+         totalMissed[p] += table[i].missed[p];
+      }
+   }
+   size_t n = order.size() < topN ? order.size() : topN;
+   std::partial_sort(order.begin(), order.begin() + n, order.end(),
+                     [](const Entry* a, const Entry* b){
+                        if(a->mispredicted != b->mispredicted) return a->mispredicted > b->mispredicted;
+                        return a->PC < b->PC;
+                     });
+
+   fprintf(out, "  %s: %zu static branches, top %zu by mispredictions\n",
+           GetName().c_str(), order.size(), n);
+   fprintf(out, "    %-10s %12s %12s %9s %10s", "PC", "EXECUTED", "MISPREDICTED", "MISS_RATE", "MPKI");
+   for(int p = 0; p < NUM_PROVIDERS; p++){
+      if(total[p] > 0) fprintf(out, " %10s", PROVIDER_NAMES[p]);
+   }
+   fprintf(out, "\n");
+   for(size_t i = 0; i < n; i++){
+      const Entry& e = *order[i];
+      fprintf(out, "    0x%08x %12llu %12llu %8.2f%% %10.4f", e.PC,
+              (unsigned long long)e.executed, (unsigned long long)e.mispredicted,
+              100.0 * e.mispredicted / e.executed,
+              numInsts ? 1000.0 * e.mispredicted / numInsts : 0.0);
+      for(int p = 0; p < NUM_PROVIDERS; p++){
+         if(total[p] > 0) fprintf(out, " %10llu", (unsigned long long)e.missed[p]);
+      }
+      fprintf(out, "\n");
+   }
+   // which components provide the predictions, and how often they are wrong
+   for(int p = 0; p < NUM_PROVIDERS; p++){
+      if(total[p] == 0) continue;
+      fprintf(out, "    provider %-8s %12llu predictions %12llu mispredicted (%.2f%%)\n",
+              PROVIDER_NAMES[p], (unsigned long long)total[p], (unsigned long long)totalMissed[p],
+              100.0 * totalMissed[p] / total[p]);
+   }
+}
+
+/////////////////////////////////////////////////////////////
+// Checkpoint files
+/////////////////////////////////////////////////////////////
+// A checkpoint is the magic "BPCK", a format version, the spec the
+// predictor was built from and the SaveState bytes. Loading rebuilds the
+// predictor from the spec, so the state only needs to hold what changes
+// while the predictor trains.
+static const char CKPT_MAGIC[4] = {'B', 'P', 'C', 'K'};
+static const UINT32 CKPT_VERSION = 1;
+
+bool SaveCheckpoint(const Predictor* pred, const char* path) {
+   StateWriter state;
+   pred->SaveState(state);
+   StateWriter head;
+   head.PutBytes(CKPT_MAGIC, sizeof(CKPT_MAGIC));
+   head.Put(CKPT_VERSION);
+   head.Put((UINT32)pred->GetName().size());
+   head.PutBytes(pred->GetName().data(), pred->GetName().size());
+   head.Put((UINT64)state.data.size());
+
+   FILE* f = fopen(path, "wb");
+   if(f == NULL) return false;
+   bool ok = fwrite(head.data.data(), 1, head.data.size(), f) == head.data.size() &&
+             fwrite(state.data.data(), 1, state.data.size(), f) == state.data.size();
+   return (fclose(f) == 0) && ok;
+}
+
+Predictor* LoadCheckpoint(const char* path) {
+   FILE* f = fopen(path, "rb");
+   if(f == NULL) return NULL;
+   std::vector<uint8_t> data;
+   uint8_t buf[65536];
+   size_t n;
+   while((n = fread(buf, 1, sizeof(buf), f)) > 0){
+      data.insert(data.end(), buf, buf + n);
+   }
+   bool readError = ferror(f);
+   fclose(f);
+   if(readError) return NULL;
+
+   StateReader in(data.data(), data.size());
+   char magic[4];
+   UINT32 version, nameLen;
+   if(!in.GetBytes(magic, sizeof(magic)) || memcmp(magic, CKPT_MAGIC, sizeof(magic)) != 0) return NULL;
+   if(!in.Get(version) || version != CKPT_VERSION || !in.Get(nameLen)) return NULL;
+   std::string spec(nameLen, '\0');
+   UINT64 stateLen;
+   if(!in.GetBytes(&spec[0], nameLen) || !in.Get(stateLen)) return NULL;
+
+   Predictor* pred = CreatePredictor(spec.c_str());
+   if(pred == NULL) return NULL;
+   if(!pred->LoadState(in) || !in.Done()){
+      delete pred;
+      return NULL;
+   }
+   return pred;
+}
+
+/////////////////////////////////////////////////////////////
+// Latency instrumentation
+/////////////////////////////////////////////////////////////
+#ifdef PREDICTOR_LATENCY
+UINT64 LatencyHistogram::Quantile(double q) const {
+   if(count == 0) return 0;
+   UINT64 rank = (UINT64)ceil(q * count);
+   if(rank == 0) rank = 1;
+   UINT64 seen = 0;
+   for(int b = 0; b < NUM_BUCKETS; b++){
+      seen += buckets[b];
+      if(seen < rank) continue;
+      if(b < (1 << SUB_BITS)) return b;
+      // bucket b covers [(4 + m) << (e - 2), ((5 + m) << (e - 2)) - 1]
+      int e = (b >> SUB_BITS) + SUB_BITS - 1;
+      UINT64 m = b & ((1 << SUB_BITS) - 1);
+      UINT64 upper = (((1ULL << SUB_BITS) + m + 1) << (e - SUB_BITS)) - 1;
+      return upper < max ? upper : max;
+   }
+   return max;
+}
+
+void LatencyHistogram::PrintHeader(FILE* out) {
+   fprintf(out, "  %-32s %12s %10s %10s %10s %10s %12s\n", "LATENCY_CYCLES", "CALLS",
+           "MEAN", "P50", "P99", "P99.9", "MAX");
+}
+
+void LatencyHistogram::Print(FILE* out) const {
+   fprintf(out, "  %-32s %12llu %10.1f %10llu %10llu %10llu %12llu\n", name.c_str(),
+           (unsigned long long)count, count ? (double)sum / count : 0.0,
+           (unsigned long long)Quantile(0.5), (unsigned long long)Quantile(0.99),
+           (unsigned long long)Quantile(0.999), (unsigned long long)max);
+}
+
+static std::vector<LatencyHistogram*>& GetLatencyRegistry() {
+   static std::vector<LatencyHistogram*> registry;
+   return registry;
+}
+
+LatencyHistogram* RegisterLatencyHistogram(const char* name) {
+   std::vector<LatencyHistogram*>& registry = GetLatencyRegistry();
+   for(size_t i = 0; i < registry.size(); i++){
+      if(registry[i]->GetName() == name) return registry[i];
+   }
+   registry.push_back(new LatencyHistogram(name));
+   return registry.back();
+}
+
+void ReportLatencyHistograms(FILE* out) {
+   std::vector<LatencyHistogram*>& registry = GetLatencyRegistry();
+   bool header = false;
+   for(size_t i = 0; i < registry.size(); i++){
+      if(registry[i]->GetCount() == 0) continue;
+      if(!header) LatencyHistogram::PrintHeader(out);
+      header = true;
+      registry[i]->Print(out);
+   }
+}
+
+LatencyPredictor::LatencyPredictor(Predictor* inner)
+   : pred(inner), predictTime(inner->GetName() + " GetPrediction"),
+     updateTime(inner->GetName() + " UpdatePredictor") {
+   SetName(inner->GetName());
+}
+
+void LatencyPredictor::Report(FILE* out) const {
+   predictTime.Print(out);
+   updateTime.Print(out);
+}
+#endif
+
+/////////////////////////////////////////////////////////////
+// Branch target prediction
+/////////////////////////////////////////////////////////////
+BranchClass ClassifyBranch(OpType opType) {
+   switch(opType){
+   case OPTYPE_BRANCH_COND:      return BRANCH_COND;
+   case OPTYPE_BRANCH_UNCOND:    return BRANCH_JUMP;
+   case OPTYPE_CALL_DIRECT:      return BRANCH_CALL;
+   case OPTYPE_INDIRECT_BR_CALL: return BRANCH_INDIRECT;
+   case OPTYPE_RET:              return BRANCH_RETURN;
+   default:                      return NOT_A_BRANCH;
+   }
+}
+
+static const char* const BRANCH_CLASS_NAMES[NUM_BRANCH_CLASSES] = {
+   "cond", "jump", "call", "indirect", "return"
+};
+
+static const char* const BTB_REPLACEMENT_NAMES[] = {"lru", "fifo", "random"};
+
+static const UINT32 MAX_INST_BYTES = 15; // longest x86 instruction
+
+BranchTargetBuffer::BranchTargetBuffer(UINT32 sets, UINT32 ways, BtbReplacement policy)
+   : numSets(sets), numWays(ways), replacement(policy), entries((size_t)sets * ways),
+     nextFifo(sets, 0), clock(0), lfsr(0xACE1u) {
+   assert(sets > 0 && (sets & (sets - 1)) == 0 && ways > 0);
+   for(size_t i = 0; i < entries.size(); i++){
+      entries[i].valid = false;
+      entries[i].PC = entries[i].target = 0;
+      entries[i].lastUse = 0;
+   }
+}
+
+// functions start aligned, so the upper PC bits are folded into the index
+UINT32 BranchTargetBuffer::SetIndex(UINT32 PC) const {
+   return (PC ^ (PC >> CeilLog2(numSets))) & (numSets - 1);
+}
+
+BranchTargetBuffer::Entry* BranchTargetBuffer::Find(UINT32 PC) {
+   Entry* set = &entries[(size_t)SetIndex(PC) * numWays];
+   for(UINT32 w = 0; w < numWays; w++){
+      if(set[w].valid && set[w].PC == PC) return &set[w];
+   }
+   return NULL;
+}
+
+bool BranchTargetBuffer::Lookup(UINT32 PC, UINT32* target) {
+   Entry* e = Find(PC);
+   if(e == NULL) return false;
+   e->lastUse = ++clock;
+   *target = e->target;
+   return true;
+}
+
+void BranchTargetBuffer::Update(UINT32 PC, UINT32 target) {
+   Entry* e = Find(PC);
+   if(e == NULL){
+      UINT32 setIdx = SetIndex(PC);
+      Entry* set = &entries[(size_t)setIdx * numWays];
+      UINT32 victim = 0;
+      while(victim < numWays && set[victim].valid) victim++;
+      if(victim == numWays){
+         if(replacement == BTB_LRU){
+            victim = 0;
+            for(UINT32 w = 1; w < numWays; w++){
+               if(set[w].lastUse < set[victim].lastUse) victim = w;
+            }
+         }else if(replacement == BTB_FIFO){
+            victim = nextFifo[setIdx];
+            nextFifo[setIdx] = (victim + 1) % numWays;
+         }else{
+            // 16-bit Galois LFSR, so runs are reproducible
+            lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xB400u);
+            victim = lfsr % numWays;
+         }
+      }
+      e = &set[victim];
+      e->valid = true;
+      e->PC = PC;
+   }
+   e->target = target;
+   e->lastUse = ++clock;
+}
+
+void BranchTargetBuffer::GetStorage(std::vector<StorageComponent>& parts) const {
+   // valid bit, a tag of the PC bits not implied by the set and a full
+   // target
+   UINT64 entryBits = 1 + (32 - CeilLog2(numSets)) + 32;
+   AddStorage(parts, "btb", (UINT64)numSets * numWays * entryBits);
+   UINT32 wayBits = CeilLog2(numWays);
+   if(replacement == BTB_LRU){
+      AddStorage(parts, "btb_lru", (UINT64)numSets * numWays * wayBits);
+   }else if(replacement == BTB_FIFO){
+      AddStorage(parts, "btb_fifo", (UINT64)numSets * wayBits);
+   }else{
+      AddStorage(parts, "btb_lfsr", 16);
+   }
+}
+
+// ITTAGE-style indirect target predictor: tagged tables indexed with
+// geometrically longer global histories, each entry holding a full
+// target and a confidence counter. The longest matching table provides
+// the target unless its entry is still unconfirmed, and without a match
+// the BTB target is used. The histories are folded by the same
+// GlobalHistory as TAGE.
+#define ITT_NHIST 8
+#define ITT_MAXHIST 200
+#define ITT_LOGG 9
+#define ITT_CONF_MAX 3
+static const int ITT_M[ITT_NHIST] = {4, 8, 14, 24, 40, 68, 116, 200};
+static const int ITT_L[ITT_NHIST] = {ITT_LOGG, ITT_LOGG, ITT_LOGG, ITT_LOGG,
+                                     ITT_LOGG, ITT_LOGG, ITT_LOGG, ITT_LOGG};
+static const int ITT_TB[ITT_NHIST] = {9, 9, 10, 10, 11, 11, 12, 12};
+
+class IndirectTargetPredictor {
+public:
+  IndirectTargetPredictor() {
+    for (int i=0; i<ITT_NHIST; i++) {
+      table[i].resize(1 << ITT_LOGG);
+      for (size_t j=0; j<table[i].size(); j++) {
+        table[i][j].tag = 0;
+        table[i][j].target = 0;
+        table[i][j].conf = 0;
+        table[i][j].useful = false;
+      }
+    }
+    ghist.init();
+    // the statistical corrector lanes are not used here
+    ghist.setup(ITT_M, ITT_L, ITT_TB, ITT_M, ITT_LOGG);
+    HitBank = AltBank = -1;
+  }
+
+  // Looks the branch up in every table. Returns false if no table
+  // matches, otherwise the predicted target.
+  bool predict(uint32_t pc, uint32_t *target) {
+    HitBank = AltBank = -1;
+    for (int i=0; i<ITT_NHIST; i++) {
+      GI[i] = (pc ^ (pc >> (ITT_LOGG - i)) ^ ghist.gidx(i)) & ((1 << ITT_LOGG) - 1);
+      GTAG[i] = (pc ^ ghist.gtag(i)) & ((1 << ITT_TB[i]) - 1);
+    }
+    for (int i=ITT_NHIST-1; i>=0; i--) {
+      if (table[i][GI[i]].tag == GTAG[i]) {
+        if (HitBank < 0) {
+          HitBank = i;
+        } else {
+          AltBank = i;
+          break;
+        }
+      }
+    }
+    if (HitBank < 0) return false;
+    const Entry &hit = table[HitBank][GI[HitBank]];
+    if (hit.conf == 0 && AltBank >= 0) {
+      *target = table[AltBank][GI[AltBank]].target;
+    } else {
+      *target = hit.target;
+    }
+    return true;
+  }
+
+  // Trains the entries found by the last predict on the real target;
+  // mispredicted says the final target (including a BTB fallback) was
+  // wrong.
+  void update(uint32_t target, bool mispredicted) {
+    if (HitBank >= 0) {
+      Entry &hit = table[HitBank][GI[HitBank]];
+      if (AltBank >= 0) {
+        bool altCorrect = table[AltBank][GI[AltBank]].target == target;
+        if (hit.target == target && !altCorrect) hit.useful = true;
+        else if (hit.target != target && altCorrect) hit.useful = false;
+      }
+      if (hit.target == target) {
+        if (hit.conf < ITT_CONF_MAX) hit.conf++;
+      } else if (hit.conf > 0) {
+        hit.conf--;
+      } else {
+        hit.target = target;
+      }
+    }
+
+    // allocate one entry in a longer table, or age the candidates
+    if (mispredicted && HitBank < ITT_NHIST-1) {
+      bool allocated = false;
+      for (int i=HitBank+1; i<ITT_NHIST; i++) {
+        Entry &e = table[i][GI[i]];
+        if (!e.useful) {
+          e.tag = GTAG[i];
+          e.target = target;
+          e.conf = 0;
+          allocated = true;
+          break;
+        }
+      }
+      if (!allocated) {
+        for (int i=HitBank+1; i<ITT_NHIST; i++) {
+          table[i][GI[i]].useful = false;
+        }
+      }
+    }
+  }
+
+  void pushHistory(bool bit) {
+    ghist.update(bit);
+  }
+
+  void GetStorage(std::vector<StorageComponent>& parts) const {
+    UINT64 bits = 0;
+    for (int i=0; i<ITT_NHIST; i++) {
+      // tag, target, confidence and useful bit
+      bits += (UINT64)(1 << ITT_LOGG) * (ITT_TB[i] + 32 + 2 + 1);
+    }
+    AddStorage(parts, "ittage", bits);
+    AddStorage(parts, "ittage_ghist", ITT_MAXHIST + 1);
+    AddStorage(parts, "ittage_folded", ghist.foldedBits());
+  }
+
+private:
+  struct Entry {
+    uint16_t tag;
+    uint32_t target;
+    uint8_t conf;
+    bool useful;
+  };
+
+  std::vector<Entry> table[ITT_NHIST];
+  GlobalHistory<ITT_NHIST, ITT_MAXHIST> ghist;
+  uint32_t GI[ITT_NHIST];
+  uint32_t GTAG[ITT_NHIST];
+  int HitBank;
+  int AltBank;
+};
+
+bool ParseTargetConfig(const char* spec, TargetConfig* cfg) {
+   // fields are bounded like the direction predictor tables, so a typo
+   // is rejected instead of attempting a huge allocation
+   char* end;
+   unsigned long long sets = strtoull(spec, &end, 0);
+   if(end == spec || *end != ':' || sets == 0 || sets > MAX_TABLE_ENTRIES || (sets & (sets - 1)) != 0) return false;
+   const char* field = end + 1;
+   unsigned long long ways = strtoull(field, &end, 0);
+   if(end == field || ways == 0 || ways > MAX_TABLE_ENTRIES / sets) return false;
+   cfg->btbSets = (UINT32)sets;
+   cfg->btbWays = (UINT32)ways;
+   if(*end == '\0') return true;
+   if(*end != ':') return false;
+
+   field = end + 1;
+   size_t len = strcspn(field, ":");
+   int policy = -1;
+   for(int p = 0; p < 3; p++){
+      if(strlen(BTB_REPLACEMENT_NAMES[p]) == len && strncmp(field, BTB_REPLACEMENT_NAMES[p], len) == 0) policy = p;
+   }
+   if(policy < 0) return false;
+   cfg->replacement = (BtbReplacement)policy;
+   if(field[len] == '\0') return true;
+
+   field += len + 1;
+   unsigned long long depth = strtoull(field, &end, 0);
+   if(end == field || depth == 0 || depth > MAX_TABLE_ENTRIES) return false;
+   cfg->rasDepth = (UINT32)depth;
+   if(*end == '\0') return true;
+   if(*end != ':') return false;
+
+   field = end + 1;
+   if(strcmp(field, "ittage") == 0) cfg->ittage = true;
+   else if(strcmp(field, "btb") == 0) cfg->ittage = false;
+   else return false;
+   return true;
+}
+
+TargetPredictor::TargetPredictor(const TargetConfig& cfg)
+   : config(cfg), btb(cfg.btbSets, cfg.btbWays, cfg.replacement), ras(cfg.rasDepth),
+     indirect(cfg.ittage ? new IndirectTargetPredictor() : NULL) {
+   for(int c = 0; c < NUM_BRANCH_CLASSES; c++){
+      executed[c] = taken[c] = missed[c] = 0;
+   }
+}
+
+TargetPredictor::~TargetPredictor() {
+   delete indirect;
+}
+
+bool TargetPredictor::Process(UINT32 PC, OpType opType, bool branchTaken, UINT32 branchTarget, bool measure) {
+   BranchClass cls = ClassifyBranch(opType);
+   if(cls == NOT_A_BRANCH) return true;
+
+   // the BTB both identifies the branch and supplies the default target
+   UINT32 predicted = 0;
+   bool ready = btb.Lookup(PC, &predicted);
+   bool hit = ready && predicted == branchTarget;
+   if(cls == BRANCH_RETURN){
+      // The trace has no instruction lengths, so the stack holds call PCs
+      // and a return is right if it lands within one (at most 15-byte)
+      // instruction after the popped call, where the decoder would have
+      // put the return address.
+      UINT32 callPC;
+      if(ras.Pop(&callPC)){
+         hit = branchTarget - callPC - 1 < MAX_INST_BYTES;
+      }
+   }else if(cls == BRANCH_INDIRECT && indirect != NULL){
+      UINT32 addr;
+      if(indirect->predict(PC, &addr)){
+         hit = (addr == branchTarget);
+      }
+      indirect->update(branchTarget, !hit);
+   }
+
+   if(branchTaken){
+      btb.Update(PC, branchTarget);
+   }
+   if(cls == BRANCH_CALL || cls == BRANCH_INDIRECT){
+      ras.Push(PC);
+   }
+   if(indirect != NULL){
+      // conditional branches contribute their direction, the others a
+      // bit of their target
+      indirect->pushHistory(cls == BRANCH_COND ? branchTaken : __builtin_parity(branchTarget));
+   }
+
+   if(measure){
+      executed[cls]++;
+      taken[cls] += branchTaken;
+      missed[cls] += branchTaken && !hit;
+   }
+   return !branchTaken || hit;
+}
+
+UINT64 TargetPredictor::GetUnconditionalMisses() const {
+   UINT64 total = 0;
+   for(int c = 0; c < NUM_BRANCH_CLASSES; c++){
+      if(c != BRANCH_COND) total += missed[c];
+   }
+   return total;
+}
+
+void TargetPredictor::GetStorage(std::vector<StorageComponent>& parts) const {
+   btb.GetStorage(parts);
+   AddStorage(parts, "ras", (UINT64)ras.Depth() * 32 + CeilLog2(ras.Depth()));
+   if(indirect != NULL) indirect->GetStorage(parts);
+}
+
+void TargetPredictor::Report(FILE* out, UINT64 numInsts) const {
+   std::vector<StorageComponent> parts;
+   GetStorage(parts);
+   UINT64 bits = 0;
+   for(size_t i = 0; i < parts.size(); i++) bits += parts[i].bits;
+   fprintf(out, "  TARGET_PREDICTOR     : btb %ux%u %s, ras %u, indirect %s, %llu bits\n",
+           config.btbSets, config.btbWays, BTB_REPLACEMENT_NAMES[config.replacement],
+           config.rasDepth, config.ittage ? "ittage" : "btb", (unsigned long long)bits);
+   fprintf(out, "  %-10s %12s %12s %14s %10s %10s\n", "CLASS", "EXECUTED", "TAKEN",
+           "TARGET_MISSES", "MISS_RATE", "MPKI");
+   for(int c = 0; c < NUM_BRANCH_CLASSES; c++){
+      if(executed[c] == 0) continue;
+      // the miss rate is over taken branches, the only ones needing a target
+      fprintf(out, "  %-10s %12llu %12llu %14llu %9.2f%% %10.4f\n", BRANCH_CLASS_NAMES[c],
+              (unsigned long long)executed[c], (unsigned long long)taken[c],
+              (unsigned long long)missed[c], taken[c] ? 100.0 * missed[c] / taken[c] : 0.0,
+              numInsts ? 1000.0 * missed[c] / numInsts : 0.0);
+   }
+}
+
+/////////////////////////////////////////////////////////////
+// Legacy entry points, each backed by a default instance
+/////////////////////////////////////////////////////////////
+static Predictor* pred_2bitsat = NULL;
+static Predictor* pred_2level = NULL;
+static Predictor* pred_openend = NULL;
+static Predictor* pred_perceptron = NULL;
+
+static void ResetPredictor(Predictor** pred, const char* spec) {
+   delete *pred;
+   *pred = CreatePredictor(spec);
+   assert(*pred != NULL);
+}
+
+void InitPredictor_2bitsat() {
+   ResetPredictor(&pred_2bitsat, "2bitsat");
+}
+
+bool GetPrediction_2bitsat(UINT32 PC) {
+   LATENCY_SCOPE("GetPrediction_2bitsat");
+   return pred_2bitsat->GetPrediction(PC);
+}
+
+void UpdatePredictor_2bitsat(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+   LATENCY_SCOPE("UpdatePredictor_2bitsat");
+   pred_2bitsat->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
+}
+
+void InitPredictor_2level() {
+   ResetPredictor(&pred_2level, "2level");
+}
+
+bool GetPrediction_2level(UINT32 PC) {
+   LATENCY_SCOPE("GetPrediction_2level");
+   return pred_2level->GetPrediction(PC);
+}
+
+void UpdatePredictor_2level(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+   LATENCY_SCOPE("UpdatePredictor_2level");
+   pred_2level->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
+}
+
 void InitPredictor_openend(){
-   tage = new my_predictor();
+   ResetPredictor(&pred_openend, "openend");
 }
 bool GetPrediction_openend(UINT32 PC){
-   return tage->predict(PC);
+   LATENCY_SCOPE("GetPrediction_openend");
+   return pred_openend->GetPrediction(PC);
 }  
 void UpdatePredictor_openend(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget){
-   tage->update(PC, resolveDir, branchTarget);   
+   LATENCY_SCOPE("UpdatePredictor_openend");
+   pred_openend->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
+}
+
+void InitPredictor_perceptron() {
+   ResetPredictor(&pred_perceptron, "perceptron");
+}
+
+bool GetPrediction_perceptron(UINT32 PC) {
+   LATENCY_SCOPE("GetPrediction_perceptron");
+   return pred_perceptron->GetPrediction(PC);
+}
+
+void UpdatePredictor_perceptron(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+   LATENCY_SCOPE("UpdatePredictor_perceptron");
+   pred_perceptron->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
 }
@@ -1,9 +1,684 @@
 #ifndef _PREDICTOR_H_
 #define _PREDICTOR_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "utils.h"
 #include "tracer.h"
 
+/////////////////////////////////////////////////////////////
+// Predictor state serialization
+/////////////////////////////////////////////////////////////
+// Raw host-endian dump of predictor state. Checkpoints are meant to be
+// reloaded by the same build on the same kind of host.
+class StateWriter {
+public:
+   template <class T> void Put(const T& v) { PutBytes(&v, sizeof(T)); }
+   template <class T> void PutArray(const T* v, size_t n) { PutBytes(v, n * sizeof(T)); }
+   void PutBytes(const void* p, size_t n) {
+      const uint8_t* b = (const uint8_t*)p;
+      data.insert(data.end(), b, b + n);
+   }
+   // packs n flags eight to a byte
+   void PutBits(const bool* v, size_t n) {
+      for(size_t i = 0; i < n; i += 8){
+         uint8_t b = 0;
+         for(size_t j = 0; j < 8 && i + j < n; j++) b |= (uint8_t)v[i + j] << j;
+         data.push_back(b);
+      }
+   }
+   std::vector<uint8_t> data;
+};
+
+// Reads back what a StateWriter produced. Every getter returns false
+// instead of reading past the end, and the failure sticks.
+class StateReader {
+public:
+   StateReader(const uint8_t* p, size_t n) : cur(p), end(p + n), ok(true) {}
+   template <class T> bool Get(T& v) { return GetBytes(&v, sizeof(T)); }
+   template <class T> bool GetArray(T* v, size_t n) { return GetBytes(v, n * sizeof(T)); }
+   bool GetBytes(void* p, size_t n) {
+      if(!ok || (size_t)(end - cur) < n) return ok = false;
+      memcpy(p, cur, n);
+      cur += n;
+      return true;
+   }
+   bool GetBits(bool* v, size_t n) {
+      for(size_t i = 0; i < n; i += 8){
+         uint8_t b;
+         if(!Get(b)) return false;
+         for(size_t j = 0; j < 8 && i + j < n; j++) v[i + j] = (b >> j) & 1;
+      }
+      return true;
+   }
+   bool Done() const { return ok && cur == end; }
+private:
+   const uint8_t* cur;
+   const uint8_t* end;
+   bool ok;
+};
+
+/////////////////////////////////////////////////////////////
+// Predictor interface
+/////////////////////////////////////////////////////////////
+// The component that produced a prediction. Predictors without separate
+// components report PROVIDER_OTHER.
+enum PredictionProvider {
+   PROVIDER_OTHER,
+   PROVIDER_BIMODAL, // TAGE base table, no tagged bank usable
+   PROVIDER_HITBANK, // longest matching tagged bank
+   PROVIDER_ALTBANK, // next longest bank, chosen over a fresh HitBank entry
+   PROVIDER_SC,      // statistical corrector overriding TAGE
+   NUM_PROVIDERS
+};
+
+// One conditional branch of a trace.
+struct BranchRecord {
+   UINT32 PC;
+   UINT32 branchTarget;
+   bool resolveDir;
+   bool measure; // counted in the statistics, false for warm-up
+   bool targetReady; // front end had the target if taken, see TargetPredictor
+};
+
+// One named piece of predictor state and its size in bits.
+struct StorageComponent {
+   std::string name;
+   UINT64 bits;
+};
+
+// Every predictor family implements this interface and keeps all of its
+// state in the instance, so several predictors (including several of the
+// same family) can be driven side by side.
+class Predictor {
+public:
+   virtual ~Predictor() {}
+   virtual bool GetPrediction(UINT32 PC) = 0;
+   virtual void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) = 0;
+
+   // Appends the bits of hardware state the predictor models, one entry
+   // per component (tables, history registers, control counters).
+   virtual void GetStorage(std::vector<StorageComponent>& parts) const = 0;
+
+   // Total of GetStorage.
+   UINT64 GetStorageBits() const;
+
+   // Serializes all state that affects future predictions. Call between
+   // branches, i.e. after UpdatePredictor and before the next
+   // GetPrediction.
+   virtual void SaveState(StateWriter& out) const = 0;
+
+   // Restores state written by SaveState of a predictor built from the
+   // same spec. Returns false if the data does not match this predictor.
+   virtual bool LoadState(StateReader& in) = 0;
+
+   // Predicts a block of consecutive branches fetched together, e.g. one
+   // fetch block, before any of their outcomes is known, writing one
+   // direction per PC to predDirs. Every branch of the block is predicted
+   // from the state at the start of the block. The default asks
+   // GetPrediction for each PC; families can compute the branches side by
+   // side.
+   virtual void PredictBlock(const UINT32* PCs, int n, bool* predDirs);
+
+   // Trains on the outcomes of the block of the last PredictBlock call,
+   // with its predictions in predDirs. Nothing else may be predicted or
+   // trained in between. The default looks each branch up again and
+   // calls UpdatePredictor on it.
+   virtual void UpdateBlock(const UINT32* PCs, int n, const bool* resolveDirs,
+                            const bool* predDirs, const UINT32* branchTargets);
+
+   // Component that produced the result of the last GetPrediction.
+   virtual PredictionProvider GetProvider() const { return PROVIDER_OTHER; }
+
+   const std::string& GetName() const { return name; }
+   void SetName(const std::string& n) { name = n; }
+
+private:
+   std::string name;
+};
+
+// A factory builds a predictor from the numeric fields of a spec and
+// returns NULL if they are not valid for the family.
+typedef Predictor* (*PredictorFactory)(const std::vector<UINT32>& args);
+
+// Adds a predictor family to the registry. Returns false if the name is
+// already taken.
+bool RegisterPredictor(const char* name, PredictorFactory factory);
+
+// Builds a predictor from a spec of the form "name[:arg]*", for example
+// "bimodal:4096", "2level:512:8:64" or "tage". Returns NULL if the family
+// is unknown or the arguments are rejected.
+Predictor* CreatePredictor(const char* spec);
+
+// Prints the registered family names to the given stream.
+void ListPredictors(FILE* out);
+
+// Prints the per-component storage breakdown of a predictor.
+void PrintStorage(FILE* out, const Predictor* pred);
+
+// Writes the predictor's spec and state to a checkpoint file. Returns
+// false on I/O errors.
+bool SaveCheckpoint(const Predictor* pred, const char* path);
+
+// Rebuilds a predictor from a checkpoint file, or returns NULL if the
+// file is unreadable or does not match its spec.
+Predictor* LoadCheckpoint(const char* path);
+
+/////////////////////////////////////////////////////////////
+// Packed 2-bit saturating counter table
+/////////////////////////////////////////////////////////////
+// 32 counters per 64-bit word, so a 4096-entry table takes 1 KB instead
+// of 16 KB. Counter values follow state_t (0 = strongly not taken,
+// 3 = strongly taken).
+class PackedCounterArray {
+public:
+   PackedCounterArray(UINT32 entries, UINT32 init)
+      : words((entries + 31) / 32, Replicate(init)) {}
+
+   UINT32 Read(UINT32 i) const {
+      return (words[i >> 5] >> ((i & 31) * 2)) & 3;
+   }
+
+   void Write(UINT32 i, UINT32 v) {
+      int shift = (i & 31) * 2;
+      words[i >> 5] = (words[i >> 5] & ~(3ULL << shift)) | ((uint64_t)(v & 3) << shift);
+   }
+
+   // taken predicts on the upper half of the counter range
+   bool Taken(UINT32 i) const { return Read(i) >= 2; }
+
+   void Update(UINT32 i, bool taken) {
+      uint64_t& w = words[i >> 5];
+      int shift = (i & 31) * 2;
+      UINT32 v = (w >> shift) & 3;
+      UINT32 nv = taken ? v + (v != 3) : v - (v != 0);
+      w ^= (uint64_t)(v ^ nv) << shift;
+   }
+
+   size_t Bytes() const { return words.size() * sizeof(uint64_t); }
+
+   void Save(StateWriter& out) const {
+      out.Put((UINT64)words.size());
+      out.PutArray(words.data(), words.size());
+   }
+
+   bool Load(StateReader& in) {
+      UINT64 n;
+      if(!in.Get(n) || n != words.size()) return false;
+      return in.GetArray(words.data(), words.size());
+   }
+
+private:
+   static uint64_t Replicate(UINT32 v) {
+      return 0x5555555555555555ULL * (v & 3);
+   }
+
+   std::vector<uint64_t> words;
+};
+
+/////////////////////////////////////////////////////////////
+// Per-branch misprediction profile
+/////////////////////////////////////////////////////////////
+// Wraps any predictor and counts executions and mispredictions per static
+// branch, split by the component that provided each prediction. The
+// counts live in an open-addressing table keyed by PC that doubles when
+// half full. Everything else is forwarded to the wrapped predictor.
+class ProfiledPredictor : public Predictor {
+public:
+   explicit ProfiledPredictor(Predictor* inner);
+   ~ProfiledPredictor();
+
+   bool GetPrediction(UINT32 PC);
+   void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget);
+   void GetStorage(std::vector<StorageComponent>& parts) const { pred->GetStorage(parts); }
+   void SaveState(StateWriter& out) const { pred->SaveState(out); }
+   bool LoadState(StateReader& in) { return pred->LoadState(in); }
+   PredictionProvider GetProvider() const { return pred->GetProvider(); }
+
+   // Whether the following branches are counted. Warm-up branches still
+   // train the wrapped predictor but stay out of the profile.
+   void SetMeasure(bool m) { measure = m; }
+
+   // Prints the topN branches with the most mispredictions, with their
+   // share of numInsts as MPKI and the mispredictions of each provider,
+   // followed by the totals per provider.
+   void Report(FILE* out, UINT64 numInsts, size_t topN) const;
+
+   size_t NumBranches() const { return used; }
+
+private:
+   struct Entry {
+      UINT32 PC;
+      UINT64 executed; // 0 marks a free slot
+      UINT64 mispredicted;
+      UINT64 provided[NUM_PROVIDERS];
+      UINT64 missed[NUM_PROVIDERS];
+   };
+
+   Entry& Find(UINT32 PC);
+   void Grow();
+
+   Predictor* pred;
+   PredictionProvider provider; // of the prediction being resolved
+   bool measure;
+   std::vector<Entry> table;
+   size_t used;
+};
+
+/////////////////////////////////////////////////////////////
+// Branch target prediction
+/////////////////////////////////////////////////////////////
+// The direction predictors above only say whether a branch is taken. The
+// front end also needs the target of every taken branch, so these model
+// where it comes from: a set-associative BTB for direct branches, an
+// ITTAGE-style predictor for indirect branches and a return address
+// stack for returns. Together they tell which taken branches would still
+// redirect fetch after a correct direction prediction.
+
+// Branch kinds as seen by the front end.
+enum BranchClass {
+   BRANCH_COND,     // conditional direct
+   BRANCH_JUMP,     // unconditional direct
+   BRANCH_CALL,     // direct call
+   BRANCH_INDIRECT, // indirect call or jump
+   BRANCH_RETURN,
+   NUM_BRANCH_CLASSES,
+   NOT_A_BRANCH = NUM_BRANCH_CLASSES
+};
+
+// Maps a trace op type to its branch class. The trace has a single op
+// type for indirect calls and jumps, so both are treated as calls.
+BranchClass ClassifyBranch(OpType opType);
+
+enum BtbReplacement {
+   BTB_LRU,
+   BTB_FIFO,
+   BTB_RANDOM
+};
+
+// Set-associative table of branch targets, tagged with the full PC.
+class BranchTargetBuffer {
+public:
+   BranchTargetBuffer(UINT32 sets, UINT32 ways, BtbReplacement policy);
+
+   // Returns true and the stored target if PC hits.
+   bool Lookup(UINT32 PC, UINT32* target);
+
+   // Records the target of a taken branch, replacing a way of its set on
+   // a miss.
+   void Update(UINT32 PC, UINT32 target);
+
+   void GetStorage(std::vector<StorageComponent>& parts) const;
+
+private:
+   struct Entry {
+      bool valid;
+      UINT32 PC;
+      UINT32 target;
+      UINT64 lastUse; // LRU order
+   };
+
+   UINT32 SetIndex(UINT32 PC) const;
+   Entry* Find(UINT32 PC);
+
+   UINT32 numSets;
+   UINT32 numWays;
+   BtbReplacement replacement;
+   std::vector<Entry> entries;   // numWays per set
+   std::vector<UINT32> nextFifo; // per set, for BTB_FIFO
+   UINT64 clock;
+   UINT32 lfsr; // for BTB_RANDOM
+};
+
+// Circular stack of return addresses, or of the calls they follow. A push
+// onto a full stack overwrites the oldest entry.
+class ReturnAddressStack {
+public:
+   explicit ReturnAddressStack(UINT32 depth) : stack(depth), top(0), count(0) {}
+
+   void Push(UINT32 addr) {
+      top = (top + 1) % stack.size();
+      stack[top] = addr;
+      if(count < stack.size()) count++;
+   }
+
+   // Returns false if the stack is empty.
+   bool Pop(UINT32* addr) {
+      if(count == 0) return false;
+      *addr = stack[top];
+      top = (top + stack.size() - 1) % stack.size();
+      count--;
+      return true;
+   }
+
+   size_t Depth() const { return stack.size(); }
+
+private:
+   std::vector<UINT32> stack;
+   size_t top;
+   size_t count;
+};
+
+class IndirectTargetPredictor;
+
+struct TargetConfig {
+   UINT32 btbSets;
+   UINT32 btbWays;
+   BtbReplacement replacement;
+   UINT32 rasDepth;
+   bool ittage; // false predicts indirect branches from the BTB alone
+};
+
+// Parses "sets:ways[:lru|fifo|random[:ras_depth[:ittage|btb]]]", e.g.
+// "512:4" or "1024:8:fifo:32:btb", on top of the defaults in cfg.
+// Returns false if the spec is malformed or asks for a BTB or return
+// stack of more than 2^26 entries.
+bool ParseTargetConfig(const char* spec, TargetConfig* cfg);
+
+// Drives the BTB, the indirect predictor and the return address stack
+// from the full instruction stream and counts target mispredictions per
+// branch class.
+class TargetPredictor {
+public:
+   explicit TargetPredictor(const TargetConfig& cfg);
+   ~TargetPredictor();
+
+   // Handles one trace record. For a branch, predicts the target, trains
+   // on the real one and returns whether the front end had it ready;
+   // other records and not-taken branches need no target and return
+   // true. Only records with measure set count in the statistics.
+   bool Process(UINT32 PC, OpType opType, bool branchTaken, UINT32 branchTarget, bool measure);
+
+   // Target mispredictions of measured branches other than conditional
+   // ones. Those depend on the direction prediction and are counted by
+   // PredictorBatch.
+   UINT64 GetUnconditionalMisses() const;
+
+   // Prints executed, taken and target-mispredicted counts per class,
+   // with MPKI over numInsts.
+   void Report(FILE* out, UINT64 numInsts) const;
+
+   void GetStorage(std::vector<StorageComponent>& parts) const;
+
+private:
+   TargetConfig config;
+   BranchTargetBuffer btb;
+   ReturnAddressStack ras;
+   IndirectTargetPredictor* indirect; // NULL with ittage off
+   UINT64 executed[NUM_BRANCH_CLASSES];
+   UINT64 taken[NUM_BRANCH_CLASSES];
+   UINT64 missed[NUM_BRANCH_CLASSES];
+};
+
+/////////////////////////////////////////////////////////////
+// Latency instrumentation
+/////////////////////////////////////////////////////////////
+// Compiled in only with -DPREDICTOR_LATENCY. Calls are timed with the
+// cycle counter into histograms with four log-spaced buckets per power
+// of two, which give p50/p99/p99.9/max to within 25% without storing
+// samples. LATENCY_SCOPE(name) times the rest of the enclosing block
+// into the histogram registered under name; without the flag it expands
+// to nothing, so the default build carries no timing code.
+#ifdef PREDICTOR_LATENCY
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline UINT64 ReadCycles() { return __rdtsc(); }
+#else
+#include <time.h>
+static inline UINT64 ReadCycles() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (UINT64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+class LatencyHistogram {
+public:
+   explicit LatencyHistogram(const std::string& n) : name(n), count(0), sum(0), max(0) {
+      memset(buckets, 0, sizeof(buckets));
+   }
+
+   void Add(UINT64 cycles) {
+      buckets[Bucket(cycles)]++;
+      count++;
+      sum += cycles;
+      if(cycles > max) max = cycles;
+   }
+
+   // Upper bound of the bucket holding quantile q (0..1), capped at the
+   // largest sample.
+   UINT64 Quantile(double q) const;
+
+   const std::string& GetName() const { return name; }
+   UINT64 GetCount() const { return count; }
+
+   // Prints a header line for Print.
+   static void PrintHeader(FILE* out);
+
+   // Prints calls, mean, p50, p99, p99.9 and max in one line.
+   void Print(FILE* out) const;
+
+private:
+   static const int SUB_BITS = 2; // 4 buckets per power of two
+   static const int NUM_BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+   static int Bucket(UINT64 v) {
+      if(v < (1u << SUB_BITS)) return (int)v;
+      int e = 63 - __builtin_clzll(v);
+      return ((e - SUB_BITS + 1) << SUB_BITS) + (int)((v >> (e - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+   }
+
+   std::string name;
+   UINT64 buckets[NUM_BUCKETS];
+   UINT64 count;
+   UINT64 sum;
+   UINT64 max;
+};
+
+// Adds the time from construction to destruction to a histogram.
+class LatencyTimer {
+public:
+   explicit LatencyTimer(LatencyHistogram* h) : hist(h), start(ReadCycles()) {}
+   ~LatencyTimer() { hist->Add(ReadCycles() - start); }
+private:
+   LatencyHistogram* hist;
+   UINT64 start;
+};
+
+// Returns the process-wide histogram registered under name, creating it
+// on first use. Not thread-safe; meant for the legacy entry points.
+LatencyHistogram* RegisterLatencyHistogram(const char* name);
+
+// Prints every registered histogram that has samples.
+void ReportLatencyHistograms(FILE* out);
+
+// Wraps any predictor and times its GetPrediction and UpdatePredictor
+// calls. Everything else is forwarded to the wrapped predictor.
+class LatencyPredictor : public Predictor {
+public:
+   explicit LatencyPredictor(Predictor* inner);
+   ~LatencyPredictor() { delete pred; }
+
+   bool GetPrediction(UINT32 PC) {
+      LatencyTimer timer(&predictTime);
+      return pred->GetPrediction(PC);
+   }
+   void UpdatePredictor(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget) {
+      LatencyTimer timer(&updateTime);
+      pred->UpdatePredictor(PC, resolveDir, predDir, branchTarget);
+   }
+   void GetStorage(std::vector<StorageComponent>& parts) const { pred->GetStorage(parts); }
+   void SaveState(StateWriter& out) const { pred->SaveState(out); }
+   bool LoadState(StateReader& in) { return pred->LoadState(in); }
+   PredictionProvider GetProvider() const { return pred->GetProvider(); }
+
+   // Prints one histogram line per entry point.
+   void Report(FILE* out) const;
+
+private:
+   Predictor* pred;
+   LatencyHistogram predictTime;
+   LatencyHistogram updateTime;
+};
+
+#define LATENCY_SCOPE(name) \
+   static LatencyHistogram* latencyHist_ = RegisterLatencyHistogram(name); \
+   LatencyTimer latencyTimer_(latencyHist_)
+
+#else
+
+#define LATENCY_SCOPE(name)
+
+#endif
+
+/////////////////////////////////////////////////////////////
+// Single-pass evaluation of a batch of predictors
+/////////////////////////////////////////////////////////////
+// Each decoded conditional branch is handed to every predictor in the
+// batch, so N configurations cost one trace read instead of N.
+//
+// Branches are buffered into fixed-size chunks, and each predictor runs
+// through a chunk one branch at a time. PredictBlock is not used: it
+// predicts a block from the state at its start, which changes the
+// results, and bench tage shows no consistent speedup from it. With more
+// than one thread the predictors are sharded round-robin over worker
+// threads, each owning its predictors' state, and the workers read a
+// chunk concurrently while the caller fills the next one. Every
+// predictor still sees the branches in trace order, so the results do not
+// depend on the thread count.
+//
+// For sampled simulation, branches outside the measured windows can be
+// fed through Warm, which trains the predictors exactly like Process but
+// keeps them out of the statistics. EndWindow closes a measured window
+// and records its MPKI as one sample, and ReportSamples turns the samples
+// into a mean with a confidence interval.
+class PredictorBatch {
+public:
+   PredictorBatch(int threads = 1) : numThreads(threads > 0 ? threads : 1) {}
+   ~PredictorBatch();
+
+   // Adds one predictor built from spec. Returns false if the spec is
+   // rejected by the registry. A spec of the form "@path" loads a
+   // checkpoint instead. Predictors can only be added before the first
+   // Process call.
+   bool Add(const char* spec);
+
+   // Adds one predictor per point of a sweep spec. A field written as
+   // "lo..hi" expands to lo, 2*lo, 4*lo, ... up to hi, and several swept
+   // fields give their cross product, e.g. "2level:512:8:16..256".
+   // Returns the number of predictors added, or 0 if any point is rejected.
+   int AddSweep(const char* spec);
+
+   // Flushes and writes predictor i to "<prefix><i>.ckpt" for every i.
+   // Returns false if any file could not be written.
+   bool SaveCheckpoints(const char* prefix);
+
+   // Predicts and trains every predictor on one conditional branch.
+   // targetReady is false if a taken outcome would redirect fetch anyway
+   // because the target was mispredicted.
+   void Process(UINT32 PC, bool resolveDir, UINT32 branchTarget, bool targetReady = true);
+
+   // Same as Process, but the branch only warms up the predictors and is
+   // not counted.
+   void Warm(UINT32 PC, bool resolveDir, UINT32 branchTarget);
+
+   // Ends a measured window of numInsts instructions and records each
+   // predictor's MPKI over the branches processed since the last call.
+   void EndWindow(UINT64 numInsts);
+
+   // Waits until every buffered branch has been evaluated. Must be called
+   // before reading per-predictor results.
+   void Flush();
+
+   // Flushes and prints per-predictor storage, mispredictions and MPKI
+   // for numInsts instructions.
+   void Report(FILE* out, UINT64 numInsts);
+
+   // Prints each predictor's fetch redirects: direction mispredictions,
+   // plus taken branches predicted taken without a ready target, plus
+   // otherMisses from branches the predictors never see.
+   void ReportRedirects(FILE* out, UINT64 numInsts, UINT64 otherMisses);
+
+   // Prints each predictor's mean window MPKI with a 95% confidence
+   // interval, from the windows closed by EndWindow.
+   void ReportSamples(FILE* out);
+
+   // Wraps every predictor in a ProfiledPredictor. Must be called after
+   // the predictors are added and before the first Process call.
+   void EnableProfiles();
+
+   // Flushes and prints the topN worst branches of every predictor.
+   // Requires EnableProfiles.
+   void ReportProfiles(FILE* out, UINT64 numInsts, size_t topN);
+
+#ifdef PREDICTOR_LATENCY
+   // Wraps every predictor in a LatencyPredictor. Must be called after
+   // the predictors are added and before the first Process call.
+   void EnableLatency();
+
+   // Flushes and prints the call latencies of every predictor. Requires
+   // EnableLatency.
+   void ReportLatency(FILE* out);
+#endif
+
+   // Returns the index of the predictor with the fewest mispredictions
+   // among those using at most budgetBits of state, or -1 if none fits.
+   // Ties go to the smaller predictor.
+   int Best(UINT64 budgetBits);
+
+   size_t Size() const { return preds.size(); }
+   Predictor* Get(size_t i) const { return preds[i]; }
+   UINT64 GetMispredictions(size_t i) const { return mispreds[i]; }
+   UINT64 GetNumBranches() const { return numBranches; }
+
+private:
+   static const size_t CHUNK_RECORDS = 1 << 16;
+
+   void Evaluate(int shard, const std::vector<BranchRecord>& records);
+   void StartWorkers();
+   void WorkerLoop(int shard);
+   void Publish();
+   void Enqueue(const BranchRecord& rec);
+
+   std::vector<Predictor*> preds;
+   std::vector<UINT64> mispreds;
+   std::vector<UINT64> redirects; // mispreds plus target misses
+   std::vector<ProfiledPredictor*> profiles; // same objects as preds once enabled
+#ifdef PREDICTOR_LATENCY
+   std::vector<LatencyPredictor*> latency; // outermost wrappers once enabled
+#endif
+   UINT64 numBranches = 0;
+
+   // sampled windows: mispredictions at the window start, and the sum and
+   // sum of squares of the window MPKIs
+   std::vector<UINT64> windowStart;
+   std::vector<double> sampleSum;
+   std::vector<double> sampleSq;
+   UINT64 numWindows = 0;
+
+   // worker state; with one thread only chunk[0] is used, by the caller
+   int numThreads;
+   std::vector<std::thread> workers;
+   std::vector<BranchRecord> chunk[2]; // one being filled, one being read
+   int fill = 0;
+   std::mutex lock;
+   std::condition_variable workReady;
+   std::condition_variable workDone;
+   const std::vector<BranchRecord>* current = NULL;
+   UINT64 generation = 0;
+   int pending = 0;
+   bool stopping = false;
+};
+
 /////////////////////////////////////////////////////////////
 
 void InitPredictor_2bitsat();
@@ -22,4 +697,10 @@ void InitPredictor_openend();
 bool GetPrediction_openend(UINT32 PC);  
 void UpdatePredictor_openend(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget);
 
-#endif
\ No newline at end of file
+/////////////////////////////////////////////////////////////
+
+void InitPredictor_perceptron();
+bool GetPrediction_perceptron(UINT32 PC);
+void UpdatePredictor_perceptron(UINT32 PC, bool resolveDir, bool predDir, UINT32 branchTarget);
+
+#endif
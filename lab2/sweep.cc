@@ -0,0 +1,376 @@
+// Single-pass driver: decodes the trace once and feeds every conditional
+// branch to a batch of predictors given as specs on the command line.
+//
+//   sweep [-j <threads>] [-b <bits>] [-s] [-p <branches>] [-skip <insts>]
+//         [-save <insts> <prefix>] [-sample <period> <warm> <window>]
+//         [-t <target spec>] [-check <report>] <trace> <spec> [<spec> ...]
+//
+// A spec is anything CreatePredictor accepts, and a field written as
+// "lo..hi" is swept over powers of two, e.g.
+//
+//   sweep trace.gz bimodal:1024..65536 2level:512:8:16..256
+//   sweep -j 4 trace.gz tage8k tage tage32k tage64k
+//
+// With -j the predictors are sharded over worker threads; the results are
+// identical for any thread count. With -b the configuration with the
+// lowest MPKI that fits in the given number of state bits is reported,
+// and -s prints each predictor's storage breakdown. -p profiles every
+// predictor per static branch and lists the given number of branches with
+// the most mispredictions, including which TAGE component provided them.
+//
+// -save writes every predictor to "<prefix><i>.ckpt" once the given number
+// of instructions has been read, and a spec of the form "@file" resumes
+// from such a checkpoint. -skip decodes and discards the first instructions
+// of the trace, so a warmed-up region can be replayed without retraining:
+//
+//   sweep -save 50000000 warm. trace.gz tage tage64k
+//   sweep -skip 50000000 trace.gz @warm.0.ckpt @warm.1.ckpt
+//
+// The trace is either a CBP trace or a packed trace written by packtrace,
+// which replays much faster; the format is detected from the file.
+//
+// -sample measures only the last <window> instructions of every <period>,
+// after training on the <warm> instructions before it; everything else in
+// the period is decoded but never reaches the predictors. The measured
+// branches go through the normal predict/update path, and the per-window
+// MPKIs are reported with a 95% confidence interval. With warm equal to
+// period - window every branch trains the predictors (functional warming)
+// and only the statistics are sampled.
+//
+//   sweep -sample 1000000 100000 10000 trace.gz tage tage64k
+//
+// -t also models target prediction for every branch in the trace: a BTB
+// of the given sets and ways, a return address stack and an ITTAGE-style
+// indirect predictor, see ParseTargetConfig. The target misses of each
+// branch class are reported, and for each predictor the fetch redirects,
+// i.e. direction mispredictions plus taken branches whose target was not
+// ready. The target state is not part of checkpoints.
+//
+//   sweep -t 512:4 trace.gz tage tage64k
+//   sweep -t 1024:8:fifo:32:btb trace.gz tage
+//
+// -check compares the misprediction counts against a report saved from an
+// earlier run, e.g. before a change that must not alter any prediction.
+// Every predictor named in the report must be in the batch with the same
+// count; sweep lists the differences and exits with an error otherwise.
+// Without specs, the predictors of the report are run.
+//
+//   sweep trace.gz tage tage64k 2level > before.txt
+//   sweep -check before.txt trace.gz tage tage64k 2level
+//
+// regress.bpt is a fixed 100000-branch trace, and regress.expected holds
+// the counts of the original predictors on it. Changes to the predictors
+// that must not alter predictions keep this passing:
+//
+//   sweep -check regress.expected regress.bpt
+//
+// In a build with -DPREDICTOR_LATENCY, -l times every GetPrediction and
+// UpdatePredictor call of each predictor and prints p50/p99/p99.9/max in
+// cycles. The option does not exist in a normal build.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+#include "packedtrace.h"
+#include "predictor.h"
+
+static void Usage(const char* prog) {
+   fprintf(stderr, "usage: %s [-j <threads>] [-b <bits>] [-s] [-p <branches>] [-skip <insts>]\n"
+                   "       [-save <insts> <prefix>] [-sample <period> <warm> <window>]\n"
+                   "       [-t <sets>:<ways>[:lru|fifo|random[:<ras depth>[:ittage|btb]]]]\n"
+                   "       [-check <report>]\n"
+                   "       <trace> <spec> [<spec> ...]   (the specs are optional with -check)\n", prog);
+#ifdef PREDICTOR_LATENCY
+   fprintf(stderr, "       -l times every predictor call\n");
+#endif
+   fprintf(stderr, "predictor families:\n");
+   ListPredictors(stderr);
+   exit(-1);
+}
+
+struct ReplayOptions {
+   UINT64 skip;
+   UINT64 saveAt;
+   const char* savePrefix;
+   UINT64 period, warm, window;
+   TargetPredictor* target; // NULL without -t
+};
+
+// Runs one record through the target predictor, if any, and hands
+// conditional branches to the batch.
+static inline void Feed(PredictorBatch& batch, const ReplayOptions& opt, bool measure,
+                        UINT32 PC, OpType opType, bool branchTaken, UINT32 branchTarget) {
+   bool targetReady = true;
+   if(opt.target != NULL){
+      targetReady = opt.target->Process(PC, opType, branchTaken, branchTarget, measure);
+   }
+   if(opType == OPTYPE_BRANCH_COND){
+      if(measure) batch.Process(PC, branchTaken, branchTarget, targetReady);
+      else batch.Warm(PC, branchTaken, branchTarget);
+   }
+}
+
+// A CBP trace has no record count to check against.
+static void CheckComplete(CBP_TRACE_READER* reader, UINT64 numRecords) {
+}
+
+// A packed trace must decode cleanly up to the record count in its
+// header; a truncated copy would otherwise pass for a short trace.
+static void CheckComplete(PackedTraceReader* reader, UINT64 numRecords) {
+   if(reader->IsCorrupt() || numRecords != reader->GetNumRecords()){
+      fprintf(stderr, "packed trace is truncated or corrupt: %llu of %llu records read\n",
+              (unsigned long long)numRecords, (unsigned long long)reader->GetNumRecords());
+      exit(-1);
+   }
+}
+
+// Feeds the trace to the batch and returns the number of measured
+// instructions. READER is CBP_TRACE_READER or PackedTraceReader.
+template <class READER>
+static UINT64 Replay(READER* reader, PredictorBatch& batch, const ReplayOptions& opt) {
+   OpType opType;
+   UINT32 PC;
+   bool branchTaken;
+   UINT32 branchTarget;
+   UINT64 numInsts = 0; // measured instructions
+   UINT64 numRead = 0;
+   UINT64 numSkipped = 0;
+
+   for(UINT64 i = 0; i < opt.skip; i++){
+      if(!reader->GetNextRecord(&PC, &opType, &branchTaken, &branchTarget)) break;
+      numSkipped++;
+   }
+   while(reader->GetNextRecord(&PC, &opType, &branchTaken, &branchTarget)){
+      numRead++;
+      if(opt.period == 0){
+         numInsts++;
+         Feed(batch, opt, true, PC, opType, branchTaken, branchTarget);
+      }else{
+         UINT64 pos = (numRead - 1) % opt.period;
+         if(pos >= opt.period - opt.window){
+            numInsts++;
+            Feed(batch, opt, true, PC, opType, branchTaken, branchTarget);
+            if(pos == opt.period - 1){
+               batch.EndWindow(opt.window);
+            }
+         }else if(pos >= opt.period - opt.window - opt.warm){
+            Feed(batch, opt, false, PC, opType, branchTaken, branchTarget);
+         }
+      }
+      if(opt.savePrefix != NULL && numRead == opt.saveAt){
+         if(!batch.SaveCheckpoints(opt.savePrefix)){
+            fprintf(stderr, "cannot write checkpoints to %s*\n", opt.savePrefix);
+            exit(-1);
+         }
+      }
+   }
+   CheckComplete(reader, numSkipped + numRead);
+   return numInsts;
+}
+
+// Reads the predictor table of a saved sweep report, the rows under the
+// first "PREDICTOR STORAGE_BITS" header, into name -> mispredictions.
+// Returns false if the file cannot be read or has no such rows.
+static bool ReadReport(const char* path, std::map<std::string, UINT64>* expected) {
+   FILE* f = fopen(path, "r");
+   if(f == NULL) return false;
+   char line[512];
+   char name[256];
+   unsigned long long bits, mispreds;
+   double mpki;
+   bool inTable = false;
+   while(fgets(line, sizeof(line), f) != NULL){
+      if(!inTable){
+         char col[2][32];
+         inTable = sscanf(line, "%31s %31s", col[0], col[1]) == 2 &&
+                   strcmp(col[0], "PREDICTOR") == 0 && strcmp(col[1], "STORAGE_BITS") == 0;
+      }else if(sscanf(line, "%255s %llu %llu %lf", name, &bits, &mispreds, &mpki) == 4){
+         (*expected)[name] = mispreds;
+      }else{
+         break;
+      }
+   }
+   fclose(f);
+   return !expected->empty();
+}
+
+// Compares the batch against the expected counts and prints every
+// difference. Returns the number of predictors that differ or are missing.
+static int CheckReport(PredictorBatch& batch, const std::map<std::string, UINT64>& expected) {
+   batch.Flush();
+   int failed = 0;
+   std::map<std::string, UINT64>::const_iterator it;
+   for(it = expected.begin(); it != expected.end(); ++it){
+      size_t i = 0;
+      while(i < batch.Size() && batch.Get(i)->GetName() != it->first) i++;
+      if(i == batch.Size()){
+         printf("  CHECK %-24s : not in this run\n", it->first.c_str());
+         failed++;
+      }else if(batch.GetMispredictions(i) != it->second){
+         printf("  CHECK %-24s : %llu mispredictions, expected %llu\n", it->first.c_str(),
+                (unsigned long long)batch.GetMispredictions(i), (unsigned long long)it->second);
+         failed++;
+      }
+   }
+   return failed;
+}
+
+int main(int argc, char* argv[]) {
+   int threads = 1;
+   UINT64 budget = 0;
+   bool storage = false;
+   size_t profileTop = 0;
+   ReplayOptions opt = {0, 0, NULL, 0, 0, 0, NULL};
+   TargetConfig targetConfig = {512, 4, BTB_LRU, 16, true};
+   bool targets = false;
+   const char* checkPath = NULL;
+   std::map<std::string, UINT64> expected;
+#ifdef PREDICTOR_LATENCY
+   bool latency = false;
+#endif
+   int arg = 1;
+   while(arg < argc && argv[arg][0] == '-'){
+      if(strcmp(argv[arg], "-j") == 0 && arg + 1 < argc){
+         threads = atoi(argv[arg + 1]);
+         arg += 2;
+      }else if(strcmp(argv[arg], "-b") == 0 && arg + 1 < argc){
+         budget = strtoull(argv[arg + 1], NULL, 0);
+         arg += 2;
+      }else if(strcmp(argv[arg], "-s") == 0){
+         storage = true;
+         arg += 1;
+      }else if(strcmp(argv[arg], "-p") == 0 && arg + 1 < argc){
+         profileTop = strtoul(argv[arg + 1], NULL, 0);
+         arg += 2;
+      }else if(strcmp(argv[arg], "-skip") == 0 && arg + 1 < argc){
+         opt.skip = strtoull(argv[arg + 1], NULL, 0);
+         arg += 2;
+      }else if(strcmp(argv[arg], "-save") == 0 && arg + 2 < argc){
+         opt.saveAt = strtoull(argv[arg + 1], NULL, 0);
+         opt.savePrefix = argv[arg + 2];
+         arg += 3;
+      }else if(strcmp(argv[arg], "-sample") == 0 && arg + 3 < argc){
+         opt.period = strtoull(argv[arg + 1], NULL, 0);
+         opt.warm = strtoull(argv[arg + 2], NULL, 0);
+         opt.window = strtoull(argv[arg + 3], NULL, 0);
+         arg += 4;
+      }else if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc){
+         if(!ParseTargetConfig(argv[arg + 1], &targetConfig)){
+            fprintf(stderr, "invalid target spec: %s\n", argv[arg + 1]);
+            exit(-1);
+         }
+         targets = true;
+         arg += 2;
+      }else if(strcmp(argv[arg], "-check") == 0 && arg + 1 < argc){
+         checkPath = argv[arg + 1];
+         if(!ReadReport(checkPath, &expected)){
+            fprintf(stderr, "cannot read report %s\n", checkPath);
+            exit(-1);
+         }
+         arg += 2;
+#ifdef PREDICTOR_LATENCY
+      }else if(strcmp(argv[arg], "-l") == 0){
+         latency = true;
+         arg += 1;
+#endif
+      }else{
+         Usage(argv[0]);
+      }
+   }
+   // with -check the specs default to the predictors of the report
+   if(argc - arg < (checkPath != NULL ? 1 : 2) || threads < 1 ||
+      (opt.period > 0 && (opt.window == 0 || opt.warm + opt.window > opt.period))){
+      Usage(argv[0]);
+   }
+
+   PredictorBatch batch(threads);
+   for(int i = arg + 1; i < argc; i++){
+      if(batch.AddSweep(argv[i]) == 0){
+         fprintf(stderr, "invalid predictor spec: %s\n", argv[i]);
+         exit(-1);
+      }
+   }
+   if(argc - arg == 1){
+      std::map<std::string, UINT64>::const_iterator it;
+      for(it = expected.begin(); it != expected.end(); ++it){
+         if(!batch.Add(it->first.c_str())){
+            fprintf(stderr, "invalid predictor spec: %s\n", it->first.c_str());
+            exit(-1);
+         }
+      }
+   }
+
+   if(profileTop > 0){
+      batch.EnableProfiles();
+   }
+   if(targets){
+      opt.target = new TargetPredictor(targetConfig);
+   }
+#ifdef PREDICTOR_LATENCY
+   if(latency){
+      batch.EnableLatency();
+   }
+#endif
+
+   UINT64 numInsts;
+   if(PackedTraceReader::IsPackedTrace(argv[arg])){
+      PackedTraceReader* reader = new PackedTraceReader();
+      if(!reader->Open(argv[arg])){
+         fprintf(stderr, "cannot read packed trace %s\n", argv[arg]);
+         exit(-1);
+      }
+      numInsts = Replay(reader, batch, opt);
+      delete reader;
+   }else{
+      CBP_TRACE_READER* cbptr = new CBP_TRACE_READER(argv[arg]);
+      numInsts = Replay(cbptr, batch, opt);
+      delete cbptr;
+   }
+
+   batch.Report(stdout, numInsts);
+   if(opt.target != NULL){
+      opt.target->Report(stdout, numInsts);
+      batch.ReportRedirects(stdout, numInsts, opt.target->GetUnconditionalMisses());
+   }
+   if(opt.period > 0){
+      batch.ReportSamples(stdout);
+   }
+   if(profileTop > 0){
+      batch.ReportProfiles(stdout, numInsts, profileTop);
+   }
+#ifdef PREDICTOR_LATENCY
+   if(latency){
+      batch.ReportLatency(stdout);
+   }
+#endif
+   if(storage){
+      for(size_t i = 0; i < batch.Size(); i++){
+         PrintStorage(stdout, batch.Get(i));
+      }
+   }
+   if(budget > 0){
+      int best = batch.Best(budget);
+      if(best < 0){
+         printf("  BEST_UNDER_%llu_BITS : none fits\n", (unsigned long long)budget);
+      }else{
+         printf("  BEST_UNDER_%llu_BITS : %s (%llu bits)\n", (unsigned long long)budget,
+                batch.Get(best)->GetName().c_str(),
+                (unsigned long long)batch.Get(best)->GetStorageBits());
+      }
+   }
+   delete opt.target;
+   if(checkPath != NULL){
+      int failed = CheckReport(batch, expected);
+      if(failed > 0){
+         printf("  CHECK_FAILED : %d of %zu predictors differ from %s\n", failed,
+                expected.size(), checkPath);
+         return -1;
+      }
+      printf("  CHECK_PASSED : %zu predictors match %s\n", expected.size(), checkPath);
+   }
+   return 0;
+}
@@ -22,6 +22,8 @@
 
 /* PARAMETERS OF THE TOMASULO'S ALGORITHM */
 
+//defaults; each becomes a -tom:* simulator option once the simulator calls
+//tomasulo_reg_options, see there
 #define INSTR_QUEUE_SIZE   16
 
 #define RESERV_INT_SIZE    5
@@ -32,6 +34,110 @@
 #define FU_INT_LATENCY     5
 #define FU_FP_LATENCY      7
 
+#define FETCH_WIDTH        1
+#define DISPATCH_WIDTH     1
+#define CDB_COUNT          1
+
+//0 disables the ROB: instructions leave the pipeline once they finish and
+//the cycle count matches the model without in-order commit
+#define ROB_SIZE           0
+#define COMMIT_WIDTH       1
+
+/* ECE552 Assignment 3 - BEGIN CODE */
+static int instr_queue_max = INSTR_QUEUE_SIZE;
+
+static int reserv_int_size = RESERV_INT_SIZE;
+static int reserv_fp_size = RESERV_FP_SIZE;
+static int fu_int_size = FU_INT_SIZE;
+static int fu_fp_size = FU_FP_SIZE;
+
+static int fu_int_latency = FU_INT_LATENCY;
+static int fu_fp_latency = FU_FP_LATENCY;
+
+static int fetch_width = FETCH_WIDTH;
+static int dispatch_width = DISPATCH_WIDTH;
+static int cdb_count = CDB_COUNT;
+
+static int rob_size = ROB_SIZE;
+static int commit_width = COMMIT_WIDTH;
+
+//cycles in which dispatch stalled because the ROB was full
+static counter_t rob_full_stalls = 0;
+
+/* 
+ * Description: 
+ * 	Registers the machine parameters as simulator options. The lab's sim-safe.c is not
+ *      part of this tree and has to make the call itself: declare
+ *          void tomasulo_reg_options(struct opt_odb_t *odb);
+ *      near the top of sim-safe.c and add
+ *          tomasulo_reg_options(odb);
+ *      as the last statement of sim_reg_options(). Until then the defaults above are used
+ *      and no -tom:* option is accepted.
+ * Inputs:
+ * 	odb: the options database
+ * Returns:
+ * 	None
+ */
+void tomasulo_reg_options(struct opt_odb_t *odb) {
+   opt_reg_int(odb, "-tom:ifq_size", "instruction fetch queue size (in insts)",
+               &instr_queue_max, /* default */INSTR_QUEUE_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:rs_int", "number of integer reservation stations",
+               &reserv_int_size, /* default */RESERV_INT_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:rs_fp", "number of floating point reservation stations",
+               &reserv_fp_size, /* default */RESERV_FP_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:fu_int", "number of integer functional units",
+               &fu_int_size, /* default */FU_INT_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:fu_fp", "number of floating point functional units",
+               &fu_fp_size, /* default */FU_FP_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:lat_int", "integer functional unit latency (in cycles)",
+               &fu_int_latency, /* default */FU_INT_LATENCY,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:lat_fp", "floating point functional unit latency (in cycles)",
+               &fu_fp_latency, /* default */FU_FP_LATENCY,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:fetch_width", "instructions fetched per cycle",
+               &fetch_width, /* default */FETCH_WIDTH,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:dispatch_width", "instructions dispatched per cycle",
+               &dispatch_width, /* default */DISPATCH_WIDTH,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:cdbs", "number of common data buses",
+               &cdb_count, /* default */CDB_COUNT,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:rob_size", "reorder buffer size (in insts), 0 for no ROB",
+               &rob_size, /* default */ROB_SIZE,
+               /* print */TRUE, /* format */NULL);
+   opt_reg_int(odb, "-tom:commit_width", "instructions committed per cycle",
+               &commit_width, /* default */COMMIT_WIDTH,
+               /* print */TRUE, /* format */NULL);
+}
+
+/* 
+ * Description: 
+ * 	Registers the Tomasulo statistics. Like tomasulo_reg_options it is called from the
+ *      lab's sim-safe.c: declare
+ *          void tomasulo_reg_stats(struct stat_sdb_t *sdb);
+ *      next to the tomasulo_reg_options prototype and add
+ *          tomasulo_reg_stats(sdb);
+ *      as the last statement of sim_reg_stats(). Until then tom_rob_full_stalls is counted
+ *      but never printed.
+ * Inputs:
+ * 	sdb: the stats database
+ * Returns:
+ * 	None
+ */
+void tomasulo_reg_stats(struct stat_sdb_t *sdb) {
+   stat_reg_counter(sdb, "tom_rob_full_stalls",
+         "cycles dispatch stalled on a full ROB",
+         &rob_full_stalls, 0, NULL);
+}
+/* ECE552 Assignment 3 - END CODE */
+
 /* IDENTIFYING INSTRUCTIONS */
 
 //unconditional branch, jump or call
@@ -77,20 +183,27 @@
 /* VARIABLES */
 
 //instruction queue for tomasulo
-static instruction_t* instr_queue[INSTR_QUEUE_SIZE];
+static instruction_t** instr_queue = NULL;
 //number of instructions in the instruction queue
 static int instr_queue_size = 0;
 
 //reservation stations (each reservation station entry contains a pointer to an instruction)
-static instruction_t* reservINT[RESERV_INT_SIZE];
-static instruction_t* reservFP[RESERV_FP_SIZE];
+static instruction_t** reservINT = NULL;
+static instruction_t** reservFP = NULL;
 
 //functional units
-static instruction_t* fuINT[FU_INT_SIZE];
-static instruction_t* fuFP[FU_FP_SIZE];
+static instruction_t** fuINT = NULL;
+static instruction_t** fuFP = NULL;
+
+//common data buses, NULL when a bus is idle
+static instruction_t** commonDataBus = NULL;
+//FU entries granted a bus in the current cycle, oldest first
+static instruction_t*** cdb_grant = NULL;
 
-//common data bus
-static instruction_t* commonDataBus = NULL;
+//reorder buffer, a circular queue of dispatched instructions in program order
+static instruction_t** rob = NULL;
+static int rob_head = 0;
+static int rob_count = 0;
 
 //The map table keeps track of which instruction produces the value for each register
 static instruction_t* map_table[MD_TOTAL_REGS];
@@ -100,12 +213,112 @@ static int fetch_index = 1;
 /* ECE552 Assignment 3 - BEGIN CODE */
 /* FUNCTIONAL UNITS */
 /* RESERVATION STATIONS */
+//free entries of each reservation station, used as a stack
+static int* freeINT = NULL;
+static int freeINT_size = 0;
+static int* freeFP = NULL;
+static int freeFP_size = 0;
+
+//ready instructions of each reservation station, a min-heap on index so
+//the top is always the oldest one
+typedef struct {
+   instruction_t** entry;
+   int size;
+} ready_queue_t;
+static ready_queue_t readyINT = {NULL, 0};
+static ready_queue_t readyFP = {NULL, 0};
+
+void ready_push(ready_queue_t* rq, instruction_t* instr){
+   int i = rq->size++;
+   while(i > 0 && rq->entry[(i - 1) / 2]->index > instr->index){
+      rq->entry[i] = rq->entry[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   rq->entry[i] = instr;
+}
+
+instruction_t* ready_pop(ready_queue_t* rq){
+   instruction_t* top = rq->entry[0];
+   instruction_t* last = rq->entry[--rq->size];
+   int i = 0;
+   while(2 * i + 1 < rq->size){
+      int c = 2 * i + 1;
+      if(c + 1 < rq->size && rq->entry[c + 1]->index < rq->entry[c]->index) c++;
+      if(rq->entry[c]->index > last->index){
+         break;
+      }
+      rq->entry[i] = rq->entry[c];
+      i = c;
+   }
+   rq->entry[i] = last;
+   return top;
+}
+
+/* WAKEUP LISTS */
+//an operand slot Q[operand] of consumer waiting on some producer's result
+typedef struct wakeup {
+   instruction_t* consumer;
+   int operand;
+   struct wakeup* next;
+} wakeup_t;
+
+//waiting consumers always sit in a reservation station, so three operands
+//per entry bound the number of live nodes
+static wakeup_t* wakeup_pool = NULL;
+static wakeup_t* wakeup_free = NULL;
+
+//simulator state instruction_t has no room for, indexed by instruction index
+typedef struct {
+   wakeup_t* consumers; // operands waiting for this instruction on the CDB
+   int reserv;          // reservation station entry held, -1 if none
+   bool done;           // finished, may commit once it reaches the ROB head
+   int commit_cycle;    // cycle it left the ROB, 0 without a ROB
+} tom_state_t;
+static tom_state_t* tom_state = NULL;
+
+static tom_state_t* state_of(instruction_t* instr){
+   assert(instr->index >= 0 && instr->index <= sim_num_insn + 1);
+   return &tom_state[instr->index];
+}
+
+void wakeup_add(instruction_t* producer, instruction_t* consumer, int operand){
+   wakeup_t* w = wakeup_free;
+   assert(w != NULL);
+   wakeup_free = w->next;
+   w->consumer = consumer;
+   w->operand = operand;
+   w->next = state_of(producer)->consumers;
+   state_of(producer)->consumers = w;
+}
+
+ready_queue_t* ready_queue_of(instruction_t* instr){
+   return USES_INT_FU(instr->op) ? &readyINT : &readyFP;
+}
+
+bool operands_ready(instruction_t* instr){
+   return instr->Q[0] == NULL && instr->Q[1] == NULL && instr->Q[2] == NULL;
+}
+
+//returns the reservation station entry of instr to its free list
+void reserv_release(instruction_t* instr){
+   tom_state_t* state = state_of(instr);
+   assert(state->reserv != -1);
+   if(USES_INT_FU(instr->op)){
+      reservINT[state->reserv] = NULL;
+      freeINT[freeINT_size++] = state->reserv;
+   } else {
+      reservFP[state->reserv] = NULL;
+      freeFP[freeFP_size++] = state->reserv;
+   }
+   state->reserv = -1;
+}
+
 /* INSTRUCTION FETCH QUEUE */
 static int ifq_head = 0; // points to the head of ifq
 static int ifq_tail = 0; // points to the tail of ifq
 void ifq_insert(instruction_t* instr){
    if(instr_queue_size != 0){
-      ifq_tail = (ifq_tail + 1) % INSTR_QUEUE_SIZE;
+      ifq_tail = (ifq_tail + 1) % instr_queue_max;
    }
    instr_queue[ifq_tail] = instr; 
    instr_queue_size++;
@@ -114,9 +327,26 @@ void ifq_insert(instruction_t* instr){
 void ifq_delete(){
    instr_queue[ifq_head] = NULL;
    if(ifq_head != ifq_tail)
-      ifq_head = (ifq_head+1) % INSTR_QUEUE_SIZE;
+      ifq_head = (ifq_head+1) % instr_queue_max;
    instr_queue_size--;
 }
+
+/* REORDER BUFFER */
+//without a ROB (rob_size 0) nothing is inserted and it is never full
+void rob_insert(instruction_t* instr){
+   if(rob_size == 0) return;
+   rob[(rob_head + rob_count) % rob_size] = instr;
+   rob_count++;
+}
+
+bool rob_full(){
+   return rob_size != 0 && rob_count == rob_size;
+}
+
+//true if the ifq head is held back only by a full ROB
+bool rob_blocks_dispatch(){
+   return instr_queue_size != 0 && rob_full();
+}
 /* ECE552 Assignment 3 - END CODE */
 
 
@@ -133,22 +363,57 @@ void ifq_delete(){
 static bool is_simulation_done(counter_t sim_insn) {
    /* ECE552 Assignment 3 - BEGIN CODE */
    if(fetch_index < sim_insn) return false;
-   for(int i = 0; i < INSTR_QUEUE_SIZE; i++)
-      if(instr_queue[i] != NULL) return false;
-   for(int i = 0; i < RESERV_INT_SIZE; i++)
-      if(reservINT[i] != NULL) return false;
-   for(int i = 0; i < RESERV_FP_SIZE; i++)
-      if(reservFP[i] != NULL) return false;
-   for(int i = 0; i < FU_INT_SIZE; i++)
+   if(instr_queue_size != 0) return false;
+   if(rob_count != 0) return false;
+   if(freeINT_size != reserv_int_size || freeFP_size != reserv_fp_size) return false;
+   for(int i = 0; i < fu_int_size; i++)
       if(fuINT[i] != NULL) return false;
-   for(int i = 0; i < FU_FP_SIZE; i++)
+   for(int i = 0; i < fu_fp_size; i++)
       if(fuFP[i] != NULL) return false;
-   if(commonDataBus != NULL) return false;
+   for(int i = 0; i < cdb_count; i++)
+      if(commonDataBus[i] != NULL) return false;
    
    return true;
    /* ECE552 Assignment 3 - END CODE */
 }
 
+/* 
+ * Description: 
+ * 	Commits up to commit_width finished instructions from the head of the ROB, in program order
+ * Inputs:
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+void ROB_To_commit(int current_cycle) {
+   /* ECE552 Assignment 3 - BEGIN CODE */
+   for(int i = 0; i < commit_width && rob_count != 0; i++){
+      instruction_t* instr = rob[rob_head];
+      if(!state_of(instr)->done) break;
+      state_of(instr)->commit_cycle = current_cycle;
+      rob[rob_head] = NULL;
+      rob_head = (rob_head + 1) % rob_size;
+      rob_count--;
+   }
+   /* ECE552 Assignment 3 - END CODE */
+}
+
+/* 
+ * Description: 
+ * 	Returns the cycle in which an instruction of the last simulated trace committed.
+ *      instr.h has no field for it, so it is kept with the rest of the per-instruction state.
+ * Inputs:
+ * 	instr: an instruction of the trace
+ * Returns:
+ * 	The commit cycle, or 0 if the ROB is disabled or instr never entered it
+ */
+int tomasulo_commit_cycle(instruction_t* instr) {
+   /* ECE552 Assignment 3 - BEGIN CODE */
+   if(tom_state == NULL) return 0;
+   return state_of(instr)->commit_cycle;
+   /* ECE552 Assignment 3 - END CODE */
+}
+
 /* 
  * Description: 
  * 	Retires the instruction from writing to the Common Data Bus
@@ -159,28 +424,29 @@ static bool is_simulation_done(counter_t sim_insn) {
  */
 void CDB_To_retire(int current_cycle) {
    /* ECE552 Assignment 3 - BEGIN CODE */
-   if(commonDataBus != NULL){
-      // broadcast to map_table
-      for(int i = 0; i < MD_TOTAL_REGS; i++){
-         if(map_table[i] == commonDataBus)
-            map_table[i] = NULL;
+   for(int c = 0; c < cdb_count; c++){
+      instruction_t* cdb = commonDataBus[c];
+      if(cdb == NULL) continue;
+      // clear the map_table entries still naming this producer
+      for(int i = 0; i < 2; i++){
+         int reg = cdb->r_out[i];
+         if(reg != DNA && map_table[reg] == cdb)
+            map_table[reg] = NULL;
       }
-      // broadcast to reserv_INT
-      for(int i = 0; i < RESERV_INT_SIZE; i++){
-         for(int j = 0; j < 3; j++){
-            if(reservINT[i] != NULL && reservINT[i]->Q[j] == commonDataBus)
-               reservINT[i]->Q[j] = NULL;
-         }
-      }
-
-      // broadcast to reserv_FP
-      for(int i = 0; i < RESERV_FP_SIZE; i++){
-         for(int j = 0; j < 3; j++){
-            if(reservFP[i] != NULL && reservFP[i]->Q[j] == commonDataBus)
-               reservFP[i]->Q[j] = NULL;
-         }
+      // wake up only the operands waiting on this producer
+      tom_state_t* state = state_of(cdb);
+      wakeup_t* w = state->consumers;
+      while(w != NULL){
+         wakeup_t* next = w->next;
+         w->consumer->Q[w->operand] = NULL;
+         if(operands_ready(w->consumer))
+            ready_push(ready_queue_of(w->consumer), w->consumer);
+         w->next = wakeup_free;
+         wakeup_free = w;
+         w = next;
       }
-      commonDataBus = NULL; 
+      state->consumers = NULL;
+      commonDataBus[c] = NULL; 
    }
    /* ECE552 Assignment 3 - END CODE */
 }
@@ -188,7 +454,28 @@ void CDB_To_retire(int current_cycle) {
 
 /* 
  * Description: 
- * 	Moves an instruction from the execution stage to common data bus (if possible)
+ * 	Offers a finished instruction to the common data buses. The granted list keeps the
+ *      cdb_count oldest offers so far, sorted by index; a younger offer drops off its end.
+ * Inputs:
+ * 	fu: the functional unit entry holding the instruction
+ * 	granted: number of entries in cdb_grant, updated
+ * Returns:
+ * 	None
+ */
+void cdb_arbitrate(instruction_t** fu, int* granted) {
+   /* ECE552 Assignment 3 - BEGIN CODE */
+   int i = *granted < cdb_count ? (*granted)++ : cdb_count;
+   while(i > 0 && (*cdb_grant[i - 1])->index > (*fu)->index){
+      if(i < cdb_count) cdb_grant[i] = cdb_grant[i - 1];
+      i--;
+   }
+   if(i < cdb_count) cdb_grant[i] = fu;
+   /* ECE552 Assignment 3 - END CODE */
+}
+
+/* 
+ * Description: 
+ * 	Moves instructions from the execution stage to the common data buses (if possible)
  * Inputs:
  * 	current_cycle: the cycle we are at
  * Returns:
@@ -196,79 +483,41 @@ void CDB_To_retire(int current_cycle) {
  */
 void execute_To_CDB(int current_cycle) {
    /* ECE552 Assignment 3 - BEGIN CODE */
-   int min_idx = -1;
-   instruction_t* instr = NULL;
+   int granted = 0;
 
-   for(int i = 0; i < FU_INT_SIZE; i++){
-      if(fuINT[i] != NULL && (current_cycle - fuINT[i]->tom_execute_cycle >= FU_INT_LATENCY)){
+   for(int i = 0; i < fu_int_size; i++){
+      if(fuINT[i] != NULL && (current_cycle - fuINT[i]->tom_execute_cycle >= fu_int_latency)){
          if(WRITES_CDB(fuINT[i]->op)){
-            if(min_idx == -1 || fuINT[i]->index < min_idx){
-               instr = fuINT[i];
-               min_idx = fuINT[i]->index;
-            } 
+            cdb_arbitrate(&fuINT[i], &granted);
          } else {
-            // free INT RS
-            for(int j = 0; j < RESERV_INT_SIZE; j++){
-               if(reservINT[j]==fuINT[i]){
-                  reservINT[j] = NULL;
-                  break;
-               }
-            }
+            state_of(fuINT[i])->done = true;
+            reserv_release(fuINT[i]);
             fuINT[i] = NULL;
          }
       }
    }
    
-   for(int i = 0; i < FU_FP_SIZE; i++){
-      if(fuFP[i] != NULL && (current_cycle - fuFP[i]->tom_execute_cycle >= FU_FP_LATENCY)){
+   for(int i = 0; i < fu_fp_size; i++){
+      if(fuFP[i] != NULL && (current_cycle - fuFP[i]->tom_execute_cycle >= fu_fp_latency)){
          if(WRITES_CDB(fuFP[i]->op)){
-             if(min_idx == -1 || fuFP[i]->index < min_idx){
-                instr = fuFP[i];
-                min_idx = fuFP[i]->index;
-             }
+            cdb_arbitrate(&fuFP[i], &granted);
           } else {
-            // free FP RS
-            for(int j = 0; j < RESERV_FP_SIZE; j++){
-               if(reservFP[j]==fuFP[i]){
-                  reservFP[j] = NULL;
-                  break;
-               }
-            }
+            state_of(fuFP[i])->done = true;
+            reserv_release(fuFP[i]);
             fuFP[i] = NULL;
           }
       }
    }
   
-   // instr finiches execution and ready to be written back
-   if(instr != NULL){
-      commonDataBus = instr;
+   // the oldest finished instructions are written back, one per bus
+   for(int c = 0; c < granted; c++){
+      instruction_t* instr = *cdb_grant[c];
+      commonDataBus[c] = instr;
       instr->tom_cdb_cycle = current_cycle;
-      // release RS
-      for(int i = 0; i < RESERV_INT_SIZE; i++){
-         if(reservINT[i]==commonDataBus){
-            reservINT[i] = NULL;
-            break;
-         }
-      }
-      for(int i = 0; i < RESERV_FP_SIZE; i++){
-         if(reservFP[i] == commonDataBus){
-            reservFP[i] = NULL;
-            break;
-         }
-      }
-      // release FU
-      for(int i = 0; i < FU_INT_SIZE; i++){
-         if(fuINT[i] == commonDataBus){
-            fuINT[i] = NULL;
-            break;
-         }
-      }
-      for(int i = 0; i < FU_FP_SIZE; i++){
-         if(fuFP[i] == commonDataBus){
-            fuFP[i] = NULL;
-            break;
-         }
-      }
+      state_of(instr)->done = true;
+      // release RS and FU
+      reserv_release(instr);
+      *cdb_grant[c] = NULL;
    }
    /* ECE552 Assignment 3 - END CODE */
 }
@@ -285,55 +534,21 @@ void execute_To_CDB(int current_cycle) {
  */
 void issue_To_execute(int current_cycle) {
    /* ECE552 Assignment 3 - BEGIN CODE */
-   for(int i = 0; i < FU_INT_SIZE; i++){
+   // the ready queues hold exactly the RS entries with all operands
+   // available that have not started executing, oldest on top
+   for(int i = 0; i < fu_int_size && readyINT.size > 0; i++){
       if(fuINT[i] == NULL){
-         // find eldest ready instruction in RS
-         instruction_t* instr = NULL;
-         int min_idx = -1;
-         for(int j = 0; j < RESERV_INT_SIZE; j++){
-            if(reservINT[j] != NULL &&
-               reservINT[j]->Q[0] == NULL &&
-               reservINT[j]->Q[1] == NULL &&
-               reservINT[j]->Q[2] == NULL &&
-               reservINT[j]->tom_execute_cycle == 0){
-               if(min_idx == -1 || reservINT[j]->index < min_idx){
-                  min_idx = reservINT[j]->index;
-                  instr = reservINT[j];
-               }
-            }
-         }
-
-         // allocate FU for the instruction
-         if(instr != NULL){
-            fuINT[i] = instr;
-            instr->tom_execute_cycle = current_cycle;
-         }
+         instruction_t* instr = ready_pop(&readyINT);
+         fuINT[i] = instr;
+         instr->tom_execute_cycle = current_cycle;
       }
    } 
 
-   for(int i = 0; i < FU_FP_SIZE; i++){
+   for(int i = 0; i < fu_fp_size && readyFP.size > 0; i++){
       if(fuFP[i] == NULL){
-         // find the oldest ready instruction in RS
-         instruction_t* instr = NULL;
-         int min_idx = -1;
-         for(int j = 0; j < RESERV_FP_SIZE; j++){
-            if(reservFP[j] != NULL &&
-               reservFP[j]->Q[0] == NULL &&
-               reservFP[j]->Q[1] == NULL &&
-               reservFP[j]->Q[2] == NULL &&
-               reservFP[j]->tom_execute_cycle == 0){
-               if(min_idx == -1 || reservFP[j]->index < min_idx){
-                  min_idx = reservFP[j]->index;
-                  instr = reservFP[j];
-               }      
-            }
-         }
-      
-         // allocate FU for the instruction
-         if(instr != NULL){
-            fuFP[i] = instr;
-            instr->tom_execute_cycle = current_cycle;
-         }
+         instruction_t* instr = ready_pop(&readyFP);
+         fuFP[i] = instr;
+         instr->tom_execute_cycle = current_cycle;
       }
    }
    /* ECE552 Assignment 3 - END CODE */
@@ -341,47 +556,59 @@ void issue_To_execute(int current_cycle) {
 
 /* 
  * Description: 
- * 	Moves instruction(s) from the dispatch stage to the issue stage
+ * 	Moves the instruction at the head of the ifq from the dispatch stage to the issue stage
  * Inputs:
  * 	current_cycle: the cycle we are at
  * Returns:
- * 	None
+ * 	True: if the instruction left the ifq
  */
-void dispatch_To_issue(int current_cycle) {
+bool dispatch_one(int current_cycle) {
    /* ECE552 Assignment 3 - BEGIN CODE */
-   if(instr_queue_size == 0) return;
+   if(instr_queue_size == 0) return false;
+   if(rob_full()) return false;
    instruction_t* curr_instr = instr_queue[ifq_head];
    if(IS_COND_CTRL(curr_instr->op) || IS_UNCOND_CTRL(curr_instr->op)){
+      // branches do not execute, they only hold their place in the ROB
+      state_of(curr_instr)->done = true;
+      rob_insert(curr_instr);
       ifq_delete();
-      return;
+      return true;
    }
    // allocate new entry in INT RS
    else if(USES_INT_FU(curr_instr->op)){
-      int reserv_int_idx;
-      for(reserv_int_idx = 0; reserv_int_idx < RESERV_INT_SIZE ; reserv_int_idx++){
-         if(reservINT[reserv_int_idx] == NULL) break;
-      }
-      if(reserv_int_idx >= RESERV_INT_SIZE) return;
+      if(freeINT_size == 0) return false;
+      int reserv_int_idx = freeINT[--freeINT_size];
       reservINT[reserv_int_idx] = curr_instr;
+      state_of(curr_instr)->reserv = reserv_int_idx;
    }
    // allocate new entry in FP RS
    else if(USES_FP_FU(curr_instr->op)){
-      int reserv_fp_idx;
-      for(reserv_fp_idx = 0; reserv_fp_idx < RESERV_FP_SIZE; reserv_fp_idx++){
-         if(reservFP[reserv_fp_idx] == NULL) break;
-      }
-      if(reserv_fp_idx >= RESERV_FP_SIZE) return;
+      if(freeFP_size == 0) return false;
+      int reserv_fp_idx = freeFP[--freeFP_size];
       reservFP[reserv_fp_idx] = curr_instr;
+      state_of(curr_instr)->reserv = reserv_fp_idx;
+   }
+   // no functional unit to run on, so it is done once it holds its ROB entry
+   else {
+      curr_instr->tom_issue_cycle = current_cycle;
+      state_of(curr_instr)->done = true;
+      rob_insert(curr_instr);
+      ifq_delete();
+      return true;
    }
    // update start cycle of issue
    curr_instr->tom_issue_cycle = current_cycle;
+   rob_insert(curr_instr);
 
    // update source registers
    for(int i = 0; i < 3; i++){
       if(curr_instr->r_in[i] != DNA && map_table[curr_instr->r_in[i]] != NULL){
          curr_instr->Q[i] = map_table[curr_instr->r_in[i]];
+         wakeup_add(curr_instr->Q[i], curr_instr, i);
       }
    }
+   if(operands_ready(curr_instr))
+      ready_push(ready_queue_of(curr_instr), curr_instr);
 
    // update map table
    for(int i = 0; i < 2; i++){
@@ -392,6 +619,27 @@ void dispatch_To_issue(int current_cycle) {
 
    // remove instruction from ifq
    ifq_delete();
+   return true;
+   /* ECE552 Assignment 3 - END CODE */
+}
+
+/* 
+ * Description: 
+ * 	Moves up to dispatch_width instructions, in program order, from the dispatch stage
+ *      to the issue stage. Stops at the first one that cannot be dispatched.
+ * Inputs:
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+void dispatch_To_issue(int current_cycle) {
+   /* ECE552 Assignment 3 - BEGIN CODE */
+   for(int i = 0; i < dispatch_width; i++){
+      if(!dispatch_one(current_cycle)){
+         if(rob_blocks_dispatch()) rob_full_stalls++;
+         break;
+      }
+   }
    /* ECE552 Assignment 3 - END CODE */
 }
 
@@ -409,7 +657,7 @@ void fetch(instruction_trace_t* trace) {
       return;
    while(IS_TRAP(get_instr(trace, fetch_index)->op))
       fetch_index++;
-   if(instr_queue_size < INSTR_QUEUE_SIZE){
+   if(instr_queue_size < instr_queue_max){
       instruction_t* instr = get_instr(trace, fetch_index);
       ifq_insert(instr);
       fetch_index++;
@@ -419,7 +667,7 @@ void fetch(instruction_trace_t* trace) {
 
 /* 
  * Description: 
- * 	Calls fetch and dispatches an instruction at the same cycle (if possible)
+ * 	Calls fetch and dispatches up to fetch_width instructions at the same cycle (if possible)
  * Inputs:
  *      trace: instruction trace with all the instructions executed
  * 	current_cycle: the cycle we are at
@@ -428,19 +676,75 @@ void fetch(instruction_trace_t* trace) {
  */
 void fetch_To_dispatch(instruction_trace_t* trace, int current_cycle) {
 
-   fetch(trace);
+   /* ECE552 Assignment 3 - BEGIN CODE */
+   for(int i = 0; i < fetch_width; i++){
+      fetch(trace);
 
+      instruction_t* instr = instr_queue[ifq_tail];
+      if(instr != NULL && instr->tom_dispatch_cycle == 0){
+         instr->tom_dispatch_cycle = current_cycle;
+      }
+   }
+   /* ECE552 Assignment 3 - END CODE */
+}
+
+/* 
+ * Description: 
+ * 	Finds the first cycle, starting at current_cycle, in which some stage can make progress.
+ *      Before it every stage leaves the pipeline untouched, e.g. while everything waits on a
+ *      functional unit, so those cycles can be skipped without changing any timing.
+ * Inputs:
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	The next cycle worth simulating
+ */
+int next_active_cycle(int current_cycle) {
    /* ECE552 Assignment 3 - BEGIN CODE */
-   instruction_t* instr = instr_queue[ifq_tail];
-   if(instr != NULL && instr->tom_dispatch_cycle == 0){
-      instr->tom_dispatch_cycle = current_cycle;
+   // an instruction to commit, a result to broadcast or an instruction to fetch
+   if(rob_count != 0 && state_of(rob[rob_head])->done) return current_cycle;
+   for(int i = 0; i < cdb_count; i++)
+      if(commonDataBus[i] != NULL) return current_cycle;
+   if(fetch_index <= sim_num_insn && instr_queue_size < instr_queue_max) return current_cycle;
+
+   // the head of the ifq can dispatch unless the ROB or its reservation station is full
+   if(instr_queue_size != 0 && !rob_full()){
+      instruction_t* instr = instr_queue[ifq_head];
+      if(IS_COND_CTRL(instr->op) || IS_UNCOND_CTRL(instr->op)) return current_cycle;
+      if(USES_INT_FU(instr->op)){
+         if(freeINT_size > 0) return current_cycle;
+      } else if(!USES_FP_FU(instr->op) || freeFP_size > 0){
+         return current_cycle;
+      }
+   }
+
+   // otherwise only a free FU with a ready instruction or a finishing FU can move
+   int next = INT_MAX;
+   for(int i = 0; i < fu_int_size; i++){
+      if(fuINT[i] == NULL){
+         if(readyINT.size > 0) return current_cycle;
+      } else {
+         int done = fuINT[i]->tom_execute_cycle + fu_int_latency;
+         if(done <= current_cycle) return current_cycle;
+         if(done < next) next = done;
+      }
+   }
+   for(int i = 0; i < fu_fp_size; i++){
+      if(fuFP[i] == NULL){
+         if(readyFP.size > 0) return current_cycle;
+      } else {
+         int done = fuFP[i]->tom_execute_cycle + fu_fp_latency;
+         if(done <= current_cycle) return current_cycle;
+         if(done < next) next = done;
+      }
    }
+   return next == INT_MAX ? current_cycle : next;
    /* ECE552 Assignment 3 - END CODE */
 }
 
 /* 
  * Description: 
- * 	Performs a cycle-by-cycle simulation of the 4-stage pipeline
+ * 	Performs a cycle-by-cycle simulation of the 4-stage pipeline followed by in-order
+ *      commit when the ROB is enabled
  * Inputs:
  *      trace: instruction trace with all the instructions executed
  * Returns:
@@ -450,27 +754,57 @@ void fetch_To_dispatch(instruction_trace_t* trace, int current_cycle) {
  */
 counter_t runTomasulo(instruction_trace_t* trace)
 {
+  /* ECE552 Assignment 3 - BEGIN CODE */
+  if (instr_queue_max < 1 || reserv_int_size < 1 || reserv_fp_size < 1 ||
+      fu_int_size < 1 || fu_fp_size < 1)
+    fatal("Tomasulo queue, reservation station and functional unit sizes must be at least 1");
+  if (fu_int_latency < 1 || fu_fp_latency < 1)
+    fatal("Tomasulo functional unit latencies must be at least 1 cycle");
+  if (fetch_width < 1 || dispatch_width < 1 || cdb_count < 1)
+    fatal("Tomasulo fetch/dispatch width and number of CDBs must be at least 1");
+  if (rob_size < 0 || commit_width < 1)
+    fatal("Tomasulo ROB size must not be negative and commit width must be at least 1");
+
+  instr_queue = (instruction_t**)calloc(instr_queue_max, sizeof(instruction_t*));
+  reservINT = (instruction_t**)calloc(reserv_int_size, sizeof(instruction_t*));
+  reservFP = (instruction_t**)calloc(reserv_fp_size, sizeof(instruction_t*));
+  fuINT = (instruction_t**)calloc(fu_int_size, sizeof(instruction_t*));
+  fuFP = (instruction_t**)calloc(fu_fp_size, sizeof(instruction_t*));
+  freeINT = (int*)calloc(reserv_int_size, sizeof(int));
+  freeFP = (int*)calloc(reserv_fp_size, sizeof(int));
+  readyINT.entry = (instruction_t**)calloc(reserv_int_size, sizeof(instruction_t*));
+  readyFP.entry = (instruction_t**)calloc(reserv_fp_size, sizeof(instruction_t*));
+  wakeup_pool = (wakeup_t*)calloc(3 * (reserv_int_size + reserv_fp_size), sizeof(wakeup_t));
+  commonDataBus = (instruction_t**)calloc(cdb_count, sizeof(instruction_t*));
+  cdb_grant = (instruction_t***)calloc(cdb_count, sizeof(instruction_t**));
+  rob = rob_size > 0 ? (instruction_t**)calloc(rob_size, sizeof(instruction_t*)) : NULL;
+  if (!instr_queue || !reservINT || !reservFP || !fuINT || !fuFP || !freeINT || !freeFP ||
+      !readyINT.entry || !readyFP.entry || !wakeup_pool || !commonDataBus || !cdb_grant ||
+      (rob_size > 0 && !rob))
+    fatal("out of virtual memory");
+  /* ECE552 Assignment 3 - END CODE */
+
   //initialize instruction queue
   int i;
-  for (i = 0; i < INSTR_QUEUE_SIZE; i++) {
+  for (i = 0; i < instr_queue_max; i++) {
     instr_queue[i] = NULL;
   }
 
   //initialize reservation stations
-  for (i = 0; i < RESERV_INT_SIZE; i++) {
+  for (i = 0; i < reserv_int_size; i++) {
       reservINT[i] = NULL;
   }
 
-  for(i = 0; i < RESERV_FP_SIZE; i++) {
+  for(i = 0; i < reserv_fp_size; i++) {
       reservFP[i] = NULL;
   }
 
   //initialize functional units
-  for (i = 0; i < FU_INT_SIZE; i++) {
+  for (i = 0; i < fu_int_size; i++) {
     fuINT[i] = NULL;
   }
 
-  for (i = 0; i < FU_FP_SIZE; i++) {
+  for (i = 0; i < fu_fp_size; i++) {
     fuFP[i] = NULL;
   }
 
@@ -479,10 +813,45 @@ counter_t runTomasulo(instruction_trace_t* trace)
   for (reg = 0; reg < MD_TOTAL_REGS; reg++) {
     map_table[reg] = NULL;
   }
+
+  /* ECE552 Assignment 3 - BEGIN CODE */
+  //every entry starts free and nothing is waiting
+  for (i = 0; i < reserv_int_size; i++) {
+    freeINT[i] = reserv_int_size - 1 - i;
+  }
+  freeINT_size = reserv_int_size;
+  for (i = 0; i < reserv_fp_size; i++) {
+    freeFP[i] = reserv_fp_size - 1 - i;
+  }
+  freeFP_size = reserv_fp_size;
+  readyINT.size = 0;
+  readyFP.size = 0;
+  rob_head = 0;
+  rob_count = 0;
+
+  wakeup_free = NULL;
+  for (i = 0; i < 3 * (reserv_int_size + reserv_fp_size); i++) {
+    wakeup_pool[i].next = wakeup_free;
+    wakeup_free = &wakeup_pool[i];
+  }
+  //kept after the run for tomasulo_commit_cycle, the next run frees it
+  free(tom_state);
+  tom_state = (tom_state_t*)calloc(sim_num_insn + 2, sizeof(tom_state_t));
+  assert(tom_state != NULL);
+  for (i = 0; i < sim_num_insn + 2; i++) {
+    tom_state[i].reserv = -1;
+  }
+  /* ECE552 Assignment 3 - END CODE */
   
   int cycle = 1;
   while (true) {
      /* ECE552 Assignment 3 - BEGIN CODE */
+     int next = next_active_cycle(cycle);
+     // dispatch would have stalled the same way in every skipped cycle
+     if (rob_blocks_dispatch())
+        rob_full_stalls += next - cycle;
+     cycle = next;
+     ROB_To_commit(cycle);
      CDB_To_retire(cycle);
      execute_To_CDB(cycle);
      issue_To_execute(cycle);
@@ -493,6 +862,31 @@ counter_t runTomasulo(instruction_trace_t* trace)
         break;
      /* ECE552 Assignment 3 - END CODE */
   }
+
+  /* ECE552 Assignment 3 - BEGIN CODE */
+  free(rob);
+  free(cdb_grant);
+  free(commonDataBus);
+  free(wakeup_pool);
+  free(readyFP.entry);
+  free(readyINT.entry);
+  free(freeFP);
+  free(freeINT);
+  free(fuFP);
+  free(fuINT);
+  free(reservFP);
+  free(reservINT);
+  free(instr_queue);
+  rob = NULL;
+  cdb_grant = NULL;
+  commonDataBus = NULL;
+  wakeup_pool = NULL;
+  readyINT.entry = readyFP.entry = NULL;
+  freeINT = freeFP = NULL;
+  fuINT = fuFP = NULL;
+  reservINT = reservFP = NULL;
+  instr_queue = NULL;
+  /* ECE552 Assignment 3 - END CODE */
   
   return cycle;
 }